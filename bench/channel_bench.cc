@@ -0,0 +1,278 @@
+// channel_bench measures Channel throughput and round-trip latency
+// next to a mutex-protected std::deque, and prints the results as JSON
+// so that runs can be compared between versions.
+//
+//   g++ -std=c++17 -O2 -pthread -I.. channel_bench.cc -o channel_bench
+//   ./channel_bench [items] > results.json
+//
+// Every combination of these is measured:
+//
+//   payload    4, 64, 512 and 4096 byte items
+//   capacity   64 and 1024 items
+//   placement  two hardware threads of one core ("smt"), two cores of
+//              one socket ("cross-core"), two sockets ("cross-socket"),
+//              or wherever the scheduler likes ("unpinned"); placements
+//              the machine does not have are skipped
+//   traffic    one item at a time ("steady") or batches of 64 with
+//              SendN/ReceiveN ("burst")
+//
+// Each result reports items per second from one sender to one
+// receiver, and the median and 99th percentile time for an item to go
+// to the other thread and back over a pair of channels.
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "channel.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const int kBurst = 64;
+const int kRoundTrips = 20000;
+
+template <int kBytes>
+struct Payload {
+  char bytes[kBytes];
+};
+
+// LockedDeque is the baseline: a bounded queue behind one mutex, with
+// the same interface as Channel.
+template <class T>
+class LockedDeque {
+public:
+  explicit LockedDeque(int capacity) : cap_(capacity) {}
+
+  bool Send(const T &item) { return SendN(&item, 1) == 1; }
+  bool Receive(T* item) { return ReceiveN(item, 1) == 1; }
+
+  int SendN(const T *items, int n) {
+    std::lock_guard<std::mutex> lock(mu_);
+    n = std::min<int>(n, cap_ - items_.size());
+    items_.insert(items_.end(), items, items + n);
+    return n;
+  }
+
+  int ReceiveN(T* items, int n) {
+    std::lock_guard<std::mutex> lock(mu_);
+    n = std::min<int>(n, items_.size());
+    std::copy(items_.begin(), items_.begin() + n, items);
+    items_.erase(items_.begin(), items_.begin() + n);
+    return n;
+  }
+
+private:
+  const int cap_;
+  std::mutex mu_;
+  std::deque<T> items_;
+};
+
+// A Placement names the CPUs for the two threads; -1 leaves a thread
+// unpinned.
+struct Placement {
+  const char* name;
+  int cpus[2];
+};
+
+int ReadInt(const std::string &path) {
+  std::ifstream in(path);
+  int value = -1;
+  in >> value;
+  return value;
+}
+
+// Placements finds one pair of CPUs for each kind of placement the
+// machine has, from the topology in sysfs.
+std::vector<Placement> Placements() {
+  std::vector<Placement> placements;
+  placements.push_back(Placement{"unpinned", {-1, -1}});
+  const int ncpu = std::thread::hardware_concurrency();
+  bool have_smt = false, have_core = false, have_socket = false;
+  for (int a = 0; a < ncpu; ++a) {
+    const std::string pa =
+        "/sys/devices/system/cpu/cpu" + std::to_string(a) + "/topology/";
+    for (int b = a + 1; b < ncpu; ++b) {
+      const std::string pb =
+          "/sys/devices/system/cpu/cpu" + std::to_string(b) + "/topology/";
+      const int socket_a = ReadInt(pa + "physical_package_id");
+      const int socket_b = ReadInt(pb + "physical_package_id");
+      const bool same_core = socket_a == socket_b &&
+                             ReadInt(pa + "core_id") == ReadInt(pb + "core_id");
+      if (socket_a < 0 || socket_b < 0) {
+        continue;
+      }
+      if (socket_a != socket_b && !have_socket) {
+        placements.push_back(Placement{"cross-socket", {a, b}});
+        have_socket = true;
+      } else if (socket_a == socket_b && same_core && !have_smt) {
+        placements.push_back(Placement{"smt", {a, b}});
+        have_smt = true;
+      } else if (socket_a == socket_b && !same_core && !have_core) {
+        placements.push_back(Placement{"cross-core", {a, b}});
+        have_core = true;
+      }
+    }
+  }
+  return placements;
+}
+
+// Pin moves the calling thread to cpu, or lets it run anywhere if cpu
+// is -1.
+void Pin(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (cpu >= 0) {
+    CPU_SET(cpu, &set);
+  } else {
+    for (unsigned i = 0; i < std::thread::hardware_concurrency(); ++i) {
+      CPU_SET(i, &set);
+    }
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+template <class Queue, class T>
+void SendAll(Queue* q, long items, bool burst) {
+  std::vector<T> batch(burst ? kBurst : 1);
+  for (long sent = 0; sent < items;) {
+    const int want = static_cast<int>(std::min<long>(batch.size(),
+                                                     items - sent));
+    const int n = burst ? q->SendN(batch.data(), want)
+                        : q->Send(batch[0]) ? 1 : 0;
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+    sent += n;
+  }
+}
+
+template <class Queue, class T>
+void ReceiveAll(Queue* q, long items, bool burst) {
+  std::vector<T> batch(burst ? kBurst : 1);
+  for (long received = 0; received < items;) {
+    const int n = burst ? q->ReceiveN(batch.data(), kBurst)
+                        : q->Receive(&batch[0]) ? 1 : 0;
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+    received += n;
+  }
+}
+
+// Throughput returns items per second from one thread to another.
+template <class Queue, class T>
+double Throughput(int capacity, const Placement &where, long items,
+                  bool burst) {
+  Queue q(capacity);
+  std::thread receiver([&] {
+    Pin(where.cpus[1]);
+    ReceiveAll<Queue, T>(&q, items, burst);
+  });
+  Pin(where.cpus[0]);
+  const auto begin = Clock::now();
+  SendAll<Queue, T>(&q, items, burst);
+  receiver.join();
+  const std::chrono::duration<double> elapsed = Clock::now() - begin;
+  Pin(-1);
+  return items / elapsed.count();
+}
+
+// RoundTrip sends single items to an echo thread and back, returning
+// the sorted round-trip times in nanoseconds.
+template <class Queue, class T>
+std::vector<double> RoundTrip(int capacity, const Placement &where) {
+  Queue ping(capacity), pong(capacity);
+  std::thread echo([&] {
+    Pin(where.cpus[1]);
+    T item;
+    for (int i = 0; i < kRoundTrips; ++i) {
+      while (!ping.Receive(&item)) {
+      }
+      while (!pong.Send(item)) {
+      }
+    }
+  });
+  Pin(where.cpus[0]);
+  std::vector<double> times;
+  times.reserve(kRoundTrips);
+  T item = T();
+  for (int i = 0; i < kRoundTrips; ++i) {
+    const auto begin = Clock::now();
+    while (!ping.Send(item)) {
+    }
+    while (!pong.Receive(&item)) {
+    }
+    times.push_back(std::chrono::duration<double, std::nano>(
+        Clock::now() - begin).count());
+  }
+  echo.join();
+  Pin(-1);
+  std::sort(times.begin(), times.end());
+  return times;
+}
+
+template <class Queue, class T>
+void Measure(const char* queue, int capacity, const Placement &where,
+             long items, bool* first) {
+  // Round trips spin on both sides, so they only make sense when the
+  // two threads can run at once.
+  std::vector<double> rtt;
+  if (where.cpus[0] >= 0 || std::thread::hardware_concurrency() > 1) {
+    rtt = RoundTrip<Queue, T>(capacity, where);
+  }
+  for (bool burst : {false, true}) {
+    const double rate = Throughput<Queue, T>(capacity, where, items, burst);
+    printf("%s\n  {\"queue\": \"%s\", \"payload\": %zu, \"capacity\": %d, "
+           "\"placement\": \"%s\", \"traffic\": \"%s\", "
+           "\"items_per_sec\": %.0f",
+           *first ? "" : ",", queue, sizeof(T), capacity, where.name,
+           burst ? "burst" : "steady", rate);
+    if (!rtt.empty()) {
+      printf(", \"rtt_p50_ns\": %.0f, \"rtt_p99_ns\": %.0f",
+             rtt[rtt.size() / 2], rtt[rtt.size() * 99 / 100]);
+    }
+    printf("}");
+    *first = false;
+  }
+}
+
+template <class T>
+void MeasurePayload(const std::vector<Placement> &placements, long items,
+                    bool* first) {
+  for (int capacity : {64, 1024}) {
+    for (const Placement &where : placements) {
+      Measure<Channel<T>, T>("channel", capacity, where, items, first);
+      Measure<LockedDeque<T>, T>("mutex_deque", capacity, where, items,
+                                 first);
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const long items = argc > 1 ? atol(argv[1]) : 1000000;
+  const std::vector<Placement> placements = Placements();
+
+  bool first = true;
+  printf("[");
+  MeasurePayload<Payload<4>>(placements, items, &first);
+  MeasurePayload<Payload<64>>(placements, items, &first);
+  MeasurePayload<Payload<512>>(placements, items, &first);
+  MeasurePayload<Payload<4096>>(placements, items, &first);
+  printf("\n]\n");
+  return 0;
+}
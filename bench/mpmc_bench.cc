@@ -0,0 +1,119 @@
+// mpmc_bench measures how MpmcChannel scales from 1 to N threads on
+// each side, next to a mutex-protected std::deque of the same capacity.
+//
+//   g++ -std=c++17 -O2 -pthread -I.. mpmc_bench.cc -o mpmc_bench
+//   ./mpmc_bench [max_threads_per_side] [items]
+//
+// Each line reports senders, receivers and items per second.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "mpmc_channel.h"
+
+namespace {
+
+const int kCapacity = 1024;
+
+// LockedDeque is the baseline: a bounded queue behind one mutex.
+class LockedDeque {
+public:
+  bool Send(const long &item) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (items_.size() == kCapacity) {
+      return false;
+    }
+    items_.push_back(item);
+    return true;
+  }
+
+  bool Receive(long* item) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (items_.empty()) {
+      return false;
+    }
+    *item = items_.front();
+    items_.pop_front();
+    return true;
+  }
+
+private:
+  std::mutex mu_;
+  std::deque<long> items_;
+};
+
+// Run moves items through q with the given number of threads per side
+// and returns items per second.
+template <class Queue>
+double Run(Queue* q, int senders, int receivers, long items) {
+  const long per_sender = items / senders;
+  const long total = per_sender * senders;
+  std::atomic<long> received(0);
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < senders; ++i) {
+    threads.emplace_back([&] {
+      while (!start.load(std::memory_order_acquire)) {
+      }
+      for (long n = 0; n < per_sender;) {
+        if (q->Send(n)) {
+          ++n;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (int i = 0; i < receivers; ++i) {
+    threads.emplace_back([&] {
+      while (!start.load(std::memory_order_acquire)) {
+      }
+      long item;
+      while (received.load(std::memory_order_relaxed) < total) {
+        if (q->Receive(&item)) {
+          received.fetch_add(1, std::memory_order_relaxed);
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  const auto begin = std::chrono::steady_clock::now();
+  start.store(true, std::memory_order_release);
+  for (auto &t : threads) {
+    t.join();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  return total / elapsed.count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int max_threads = std::thread::hardware_concurrency() / 2;
+  if (argc > 1) {
+    max_threads = atoi(argv[1]);
+  }
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+  const long items = argc > 2 ? atol(argv[2]) : 10000000;
+
+  printf("%-8s %-9s %16s %16s\n",
+         "senders", "receivers", "mpmc items/s", "deque items/s");
+  for (int n = 1; n <= max_threads; ++n) {
+    MpmcChannel<long> channel(kCapacity);
+    LockedDeque deque;
+    const double c = Run(&channel, n, n, items);
+    const double d = Run(&deque, n, n, items);
+    printf("%-8d %-9d %16.0f %16.0f\n", n, n, c, d);
+  }
+  return 0;
+}
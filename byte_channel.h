@@ -0,0 +1,175 @@
+// ByteChannel is a wait-free ring-buffer of variable-length byte
+// records for inter-thread communication. It is safe with one sender
+// and one receiver. Records are stored contiguously in the ring, so
+// neither side allocates per message.
+
+#ifndef BYTE_CHANNEL_H
+#define BYTE_CHANNEL_H
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include "channel.h"
+
+class ByteChannel {
+  static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                "No guarantee that ByteChannel is lock-free on this platform");
+
+public:
+  // Create a channel holding capacity bytes of records, including an
+  // 8-byte header per record. The capacity is rounded up to a multiple
+  // of 8.
+  explicit ByteChannel(int capacity)
+      : size_(Align(capacity)), buf_(new char[size_]),
+        r_(0), w_cache_(0), r_pos_(0), next_pos_(0), peeked_(0),
+        w_(0), r_cache_(0), w_pos_(0), pad_(0) {
+    assert(capacity >= 2 * kHeader);
+  }
+  ~ByteChannel() { delete[] buf_; }
+
+  // The number of bytes the channel holds.
+  int capacity() const { return size_; }
+
+  // The largest record the channel takes. Any record up to half the
+  // capacity fits once the receiver has caught up, wherever the ring
+  // currently wraps.
+  int max_record() const { return size_ / 2 - kHeader; }
+
+  // Reserve returns room for a record of n bytes that the sender can
+  // fill in place, or null if it does not fit right now. The room is
+  // 8-byte aligned. The receiver sees nothing until Commit.
+  char* Reserve(int n);
+
+  // Commit publishes the record from the last Reserve, trimmed to n
+  // bytes, which must not be more than were reserved.
+  void Commit(int n);
+
+  // Send copies n bytes into a record and publishes it. It returns
+  // false if the record does not fit right now.
+  bool Send(const void* data, int n);
+
+  // Peek returns the next record and sets *n to its length, or returns
+  // null if there is none. The record stays in place until Release.
+  const char* Peek(int* n);
+
+  // Release frees the record from the last Peek.
+  void Release();
+
+private:
+  // Every record starts with a header holding its length, and records
+  // start on 8-byte boundaries. A record never wraps: when one does not
+  // fit before the end of the ring, the sender writes a padding header
+  // in the leftover bytes and puts the record at the start instead.
+  static constexpr int kHeader = 8;
+  static constexpr uint32_t kPadding = 0xffffffff;
+
+  static int Align(int n) { return (n + kHeader - 1) & ~(kHeader - 1); }
+
+  // Writable returns whether n more bytes fit, refreshing r_cache_ if
+  // the cached view is not enough.
+  bool Writable(uint32_t w, int n);
+
+  // Read-only after construction.
+  alignas(kCacheLineSize) int size_;
+  char *buf_;
+
+  // r_ and w_ count every byte ever released and committed, padding
+  // included. Each side tracks where its counter points in the ring in
+  // r_pos_ or w_pos_.
+
+  // Owned by the receiver. w_cache_ is the receiver's last view of w_.
+  // The last Peek will release peeked_ bytes and move r_pos_ to
+  // next_pos_.
+  alignas(kCacheLineSize) std::atomic<uint32_t> r_;
+  uint32_t w_cache_;
+  int r_pos_, next_pos_, peeked_;
+
+  // Owned by the sender. r_cache_ is the sender's last view of r_; pad_
+  // is the number of bytes the last Reserve skipped at the end of the
+  // ring.
+  alignas(kCacheLineSize) std::atomic<uint32_t> w_;
+  uint32_t r_cache_;
+  int w_pos_, pad_;
+};
+
+inline bool ByteChannel::Writable(uint32_t w, int n) {
+  if (static_cast<int>(size_ - (w - r_cache_)) < n) {
+    r_cache_ = r_.load(std::memory_order_acquire); // observe any reads
+    if (static_cast<int>(size_ - (w - r_cache_)) < n) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline char* ByteChannel::Reserve(int n) {
+  const uint32_t w = w_.load(std::memory_order_relaxed); // we own w_
+  const int len = kHeader + Align(n);
+  const int tail = size_ - w_pos_;
+  pad_ = len <= tail ? 0 : tail;
+  if (n > max_record() || !Writable(w, pad_ + len)) {
+    return nullptr;
+  }
+  return buf_ + (pad_ ? 0 : w_pos_) + kHeader;
+}
+
+inline void ByteChannel::Commit(int n) {
+  const uint32_t w = w_.load(std::memory_order_relaxed); // we own w_
+  if (pad_) {
+    memcpy(buf_ + w_pos_, &kPadding, sizeof(kPadding));
+    w_pos_ = 0;
+  }
+  const uint32_t length = n;
+  memcpy(buf_ + w_pos_, &length, sizeof(length));
+  const int len = kHeader + Align(n);
+  w_pos_ += len;
+  if (w_pos_ == size_) {
+    w_pos_ = 0;
+  }
+  w_.store(w + pad_ + len, std::memory_order_release); // publish the write
+}
+
+inline bool ByteChannel::Send(const void* data, int n) {
+  char* room = Reserve(n);
+  if (room == nullptr) {
+    return false;
+  }
+  memcpy(room, data, n);
+  Commit(n);
+  return true;
+}
+
+inline const char* ByteChannel::Peek(int* n) {
+  const uint32_t r = r_.load(std::memory_order_relaxed); // we own r_
+  if (r == w_cache_) {
+    w_cache_ = w_.load(std::memory_order_acquire); // observe any writes
+    if (r == w_cache_) {
+      return nullptr;
+    }
+  }
+  int pos = r_pos_;
+  uint32_t length;
+  memcpy(&length, buf_ + pos, sizeof(length));
+  peeked_ = 0;
+  if (length == kPadding) {
+    // The sender publishes padding together with the record after it.
+    peeked_ = size_ - pos;
+    pos = 0;
+    memcpy(&length, buf_, sizeof(length));
+  }
+  const int len = kHeader + Align(length);
+  peeked_ += len;
+  next_pos_ = pos + len == size_ ? 0 : pos + len;
+  *n = length;
+  return buf_ + pos + kHeader;
+}
+
+inline void ByteChannel::Release() {
+  const uint32_t r = r_.load(std::memory_order_relaxed); // we own r_
+  r_pos_ = next_pos_;
+  r_.store(r + peeked_, std::memory_order_release); // publish the read
+}
+
+#endif  // BYTE_CHANNEL_H
@@ -4,68 +4,1264 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
-#include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
 
-#if ATOMIC_INT_LOCK_FREE != 2
-#error No guarantee that Channel is lock-free on this platform.
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #endif
 
+// The sender's and receiver's indices live on separate lines of this
+// size so that a write to one does not invalidate the other.
+constexpr int kCacheLineSize = 64;
+
+// Passed as Channel's N to choose the capacity at runtime.
+constexpr int kDynamicCapacity = -1;
+
+namespace channel_internal {
+
+// CpuRelax tells the CPU that the caller is spinning.
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+}  // namespace channel_internal
+
+// A WaitStrategy decides how SendWait and ReceiveWait pass the time
+// while the channel is full or empty. A Channel keeps one instance for
+// each side and calls
+//
+//   template <class Ready> void Wait(Ready ready);
+//   template <class Ready, class Clock, class Duration>
+//   bool WaitUntil(Ready ready,
+//                  const std::chrono::time_point<Clock, Duration> &deadline);
+//
+// to block until ready() returns true, or with WaitUntil until the
+// deadline passes, in which case it returns false. WaitUntil is only
+// needed by the timed calls such as ReceiveFor. The other side calls
+// Notify() on the instance each time it publishes its index. Notify is on the
+// Send/Receive fast path, so it must be cheap when nobody is waiting.
+
+// BusySpin retries as fast as it can. It has the lowest wake-up latency
+// and burns a whole core while waiting; Notify is free. This is the
+// default, so a Channel that never blocks pays nothing for waiting.
+class BusySpin {
+public:
+  template <class Ready>
+  void Wait(Ready ready) {
+    while (!ready()) {
+    }
+  }
+
+  template <class Ready, class Clock, class Duration>
+  bool WaitUntil(Ready ready,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    while (!ready()) {
+      if (Clock::now() >= deadline) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Notify() {}
+};
+
+// YieldingWait spins with a pause instruction for a while and then
+// yields the CPU between retries. Notify is free.
+class YieldingWait {
+public:
+  template <class Ready>
+  void Wait(Ready ready) {
+    for (int i = 0; !ready(); ++i) {
+      if (i < kSpins) {
+        channel_internal::CpuRelax();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  template <class Ready, class Clock, class Duration>
+  bool WaitUntil(Ready ready,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    for (int i = 0; !ready(); ++i) {
+      if (Clock::now() >= deadline) {
+        return false;
+      }
+      if (i < kSpins) {
+        channel_internal::CpuRelax();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    return true;
+  }
+
+  void Notify() {}
+
+private:
+  static const int kSpins = 1024;
+};
+
+// BackoffWait spins for a while and then sleeps between retries, doubling
+// the sleep up to a millisecond. It uses little CPU but can add up to a
+// millisecond of latency. Notify is free.
+class BackoffWait {
+public:
+  template <class Ready>
+  void Wait(Ready ready) {
+    for (int i = 0; i < kSpins; ++i) {
+      if (ready()) {
+        return;
+      }
+      channel_internal::CpuRelax();
+    }
+    std::chrono::microseconds pause(1);
+    while (!ready()) {
+      std::this_thread::sleep_for(pause);
+      pause = std::min(pause * 2, std::chrono::microseconds(1000));
+    }
+  }
+
+  // WaitUntil sleeps no later than the deadline.
+  template <class Ready, class Clock, class Duration>
+  bool WaitUntil(Ready ready,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    for (int i = 0; i < kSpins; ++i) {
+      if (ready()) {
+        return true;
+      }
+      channel_internal::CpuRelax();
+    }
+    std::chrono::microseconds pause(1);
+    while (!ready()) {
+      const typename Clock::time_point now = Clock::now();
+      if (now >= deadline) {
+        return false;
+      }
+      if (deadline - now < pause) {
+        std::this_thread::sleep_until(deadline);
+      } else {
+        std::this_thread::sleep_for(pause);
+      }
+      pause = std::min(pause * 2, std::chrono::microseconds(1000));
+    }
+    return true;
+  }
+
+  void Notify() {}
+
+private:
+  static const int kSpins = 1024;
+};
+
+// FutexWait spins briefly and then sleeps on a futex until the other
+// side notifies it. It uses no CPU while waiting; Notify costs a fence
+// and a load when nobody is waiting. Outside Linux it yields instead of
+// sleeping. SharedFutexWait is the same for a channel in memory shared
+// between processes.
+template <bool kProcessShared>
+class BasicFutexWait {
+public:
+  BasicFutexWait() : epoch_(0), waiters_(0) {}
+
+  template <class Ready>
+  void Wait(Ready ready);
+
+  // WaitUntil sleeps on the futex with a timeout of whatever is left
+  // until the deadline.
+  template <class Ready, class Clock, class Duration>
+  bool WaitUntil(Ready ready,
+                 const std::chrono::time_point<Clock, Duration> &deadline);
+
+  void Notify();
+
+private:
+  static const int kSpins = 128;
+
+#if defined(__linux__)
+  static const int kWaitOp = kProcessShared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+  static const int kWakeOp = kProcessShared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+#endif
+
+  // Sleep waits for epoch_ to change from epoch, for at most timeout
+  // if it is not null.
+  void Sleep(uint32_t epoch, const std::chrono::nanoseconds *timeout) {
+#if defined(__linux__)
+    struct timespec ts;
+    if (timeout != nullptr) {
+      ts.tv_sec = timeout->count() / 1000000000;
+      ts.tv_nsec = timeout->count() % 1000000000;
+    }
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_),
+            kWaitOp, epoch, timeout != nullptr ? &ts : nullptr, nullptr, 0);
+#else
+    (void)epoch;
+    (void)timeout;
+    std::this_thread::yield();
+#endif
+  }
+
+  void Wake() {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_),
+            kWakeOp, 1, nullptr, nullptr, 0);
+#endif
+  }
+
+  // epoch_ is the futex word; Notify bumps it so that a waiter that
+  // read the old value does not go to sleep.
+  std::atomic<uint32_t> epoch_;
+  std::atomic<uint32_t> waiters_;
+};
+
+template <bool kProcessShared>
+template <class Ready>
+void BasicFutexWait<kProcessShared>::Wait(Ready ready) {
+  for (int i = 0; i < kSpins; ++i) {
+    if (ready()) {
+      return;
+    }
+    channel_internal::CpuRelax();
+  }
+  for (;;) {
+    const uint32_t epoch = epoch_.load(std::memory_order_acquire);
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    // Either ready() sees the other side's progress, or the other
+    // side's Notify sees us in waiters_ and bumps epoch_.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ready()) {
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+      return;
+    }
+    Sleep(epoch, nullptr);
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+template <bool kProcessShared>
+template <class Ready, class Clock, class Duration>
+bool BasicFutexWait<kProcessShared>::WaitUntil(
+    Ready ready, const std::chrono::time_point<Clock, Duration> &deadline) {
+  for (int i = 0; i < kSpins; ++i) {
+    if (ready()) {
+      return true;
+    }
+    channel_internal::CpuRelax();
+  }
+  for (;;) {
+    const uint32_t epoch = epoch_.load(std::memory_order_acquire);
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    // As in Wait.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ready()) {
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    const std::chrono::nanoseconds left =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline - Clock::now());
+    if (left.count() <= 0) {
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+    Sleep(epoch, &left);
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+template <bool kProcessShared>
+void BasicFutexWait<kProcessShared>::Notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiters_.load(std::memory_order_relaxed) != 0) {
+    epoch_.fetch_add(1, std::memory_order_release);
+    Wake();
+  }
+}
+
+typedef BasicFutexWait<false> FutexWait;
+typedef BasicFutexWait<true> SharedFutexWait;
+
+// ReceiveStatus is the outcome of Channel::TryReceive.
+enum class ReceiveStatus {
+  kReceived,  // an item was taken
+  kEmpty,     // no item is waiting, but more may come
+  kClosed,    // the sender has closed the channel and it is drained
+};
+
+// A Stats policy watches a Channel's traffic. A Channel keeps one
+// instance, constructed with the number of slots, and calls
+//
+//   void Sent(int pos, int n);      // by the sender, before publishing
+//   void Received(int pos, int n);  // by the receiver, before releasing
+//   void SendFull();                // by the sender, finding no room
+//   void ReceiveEmpty();            // by the receiver, finding no items
+//   void Waiting(int n);            // by the receiver, on reloading w_
+//
+// Sent and Received are called once per successful operation, for the
+// n items in the slots from pos on, which may wrap around the end of
+// the ring. Waiting is told how many items the receiver found in the
+// channel each time it looked. Other threads can read the instance
+// through Channel::stats(). channel_stats.h has the policies that
+// record something.
+//
+// A policy also sets kSeparateSides to whether the sender's calls and
+// the receiver's calls touch no state in common. The rendezvous
+// Channel<T, 0> only takes policies that do, since both of its sides
+// record the same hand-off at once.
+
+// NoStats records nothing, so a Channel without stats compiles to the
+// same code as one from before stats existed. This is the default.
+class NoStats {
+public:
+  static constexpr bool kSeparateSides = true;
+
+  explicit NoStats(int) {}
+
+  void Sent(int, int) {}
+  void Received(int, int) {}
+  void SendFull() {}
+  void ReceiveEmpty() {}
+  void Waiting(int) {}
+};
+
+// A Publish policy says when each side of a Channel publishes its
+// index. PublishEach publishes after every operation; this is the
+// default, and costs one store per operation. PublishBatched lets each
+// side hold its index back for a batch of items; see
+// Channel::SetSendBatch.
+struct PublishEach {
+  static constexpr bool kBatched = false;
+};
+struct PublishBatched {
+  static constexpr bool kBatched = true;
+};
+
+namespace channel_internal {
+
+// Ring holds a Channel's slots as raw storage; an item only exists
+// between its construction by the sender and its destruction by the
+// receiver. There are exactly as many slots as the capacity. With a
+// capacity N fixed at compile time the slots are an inline array and
+// the sizes are constants.
+template <class T, int N>
+class Ring {
+public:
+  static_assert(N > 0, "Ring needs at least one slot");
+
+  explicit Ring(int capacity) { assert(capacity == N); (void)capacity; }
+
+  static constexpr int capacity() { return N; }
+  static constexpr int size() { return N; }
+
+  // Wrap maps a position in [0, 2*size()) into the ring. A power of 2
+  // size reduces to a mask.
+  static int Wrap(int pos) {
+    return (N & (N-1)) == 0 ? pos & (N-1) : (pos >= N ? pos - N : pos);
+  }
+
+  T* slot(int i) { return reinterpret_cast<T*>(&buf_[i]); }
+
+private:
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+  Storage buf_[N];
+};
+
+// With kDynamicCapacity the slots are allocated when the Channel is
+// created.
 template <class T>
+class Ring<T, kDynamicCapacity> {
+public:
+  explicit Ring(int capacity) : size_(capacity), buf_(new Storage[size_]) {
+    assert(capacity > 0);
+  }
+  ~Ring() { delete[] buf_; }
+
+  int capacity() const { return size_; }
+  int size() const { return size_; }
+
+  // Wrap maps a position in [0, 2*size()) into the ring.
+  int Wrap(int pos) const { return pos >= size_ ? pos - size_ : pos; }
+
+  T* slot(int i) { return reinterpret_cast<T*>(&buf_[i]); }
+
+private:
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  int size_;
+  Storage *buf_;
+};
+
+}  // namespace channel_internal
+
+// N is the capacity when it is known at compile time, in which case
+// the slots are stored inline and the index arithmetic uses constants:
+//
+//   Channel<float, 256> c;  // no heap allocation
+//
+// The default, kDynamicCapacity, takes the capacity in the constructor,
+// which must be at least 1. A capacity of 0 is a rendezvous; see
+// Channel<T, 0> below.
+//
+// Index is the type of the read and write counters. It must be unsigned
+// and able to count to the capacity: uint16_t is enough for a small
+// channel, and uint64_t counters never wrap.
+//
+// Stats is told about every item sent and received; see NoStats.
+//
+// Publish says when each side publishes its index; see PublishEach.
+template <class T, int N = kDynamicCapacity, class WaitStrategy = BusySpin,
+          class Index = uint32_t, class Stats = NoStats,
+          class Publish = PublishEach>
 class Channel {
+  static_assert(std::is_unsigned<Index>::value, "Index must be unsigned");
+  static_assert(std::atomic<Index>::is_always_lock_free,
+                "No guarantee that Channel is lock-free on this platform");
+
 public:
   // Create a channel.
-  explicit Channel(int capacity) : cap_(capacity), r_(0), w_(0) {
-    assert(capacity >= 0);
-    // Round up to next power of 2.
-    int power = floor(log(capacity)/log(2)) + 1;
-    size_ = 1 << power;
-    size_mask_ = size_ - 1;
-    buf_ = new T[size_];
+  explicit Channel(int capacity)
+      : ring_(capacity),
+        r_(0), r_next_(0), w_cache_(0), r_pos_(0), receive_batch_(1),
+        w_(0), w_next_(0), r_cache_(0), w_pos_(0), send_batch_(1),
+        closed_(false), stats_(ring_.size()) {
+    assert(static_cast<uint64_t>(capacity) <=
+           std::numeric_limits<Index>::max());
+  }
+
+  // Create a channel with the compile-time capacity N.
+  Channel() : Channel(N) {
+    static_assert(N != kDynamicCapacity, "Channel needs a capacity");
+  }
+
+  ~Channel() {
+    int pos = r_pos_;
+    for (int n = Count(SendCount(), ReceiveCount()); n > 0; --n) {
+      ring_.slot(pos)->~T();
+      pos = ring_.Wrap(pos + 1);
+    }
   }
-  ~Channel() { delete[] buf_; }
 
   // The capacity passed to the constructor.
-  int capacity() const { return cap_; }
+  int capacity() const { return ring_.capacity(); }
+
+  // The Stats policy instance.
+  const Stats& stats() const { return stats_; }
 
   // Send attempts to put an item onto the channel. It returns true if
-  // it succeeded (the channel was not already full).
-  bool Send(const T &item);
+  // it succeeded (the channel was not already full). The item is only
+  // moved from on success.
+  bool Send(const T &item) { return Emplace(item); }
+  bool Send(T &&item) { return Emplace(std::move(item)); }
+
+  // Emplace is Send with the item constructed from args directly in
+  // the ring.
+  template <class... Args>
+  bool Emplace(Args&&... args);
 
   // Receive attempts to take an item from the channel. It return true
-  // if it succeeded (the channel was not already empty).
+  // if it succeeded (the channel was not already empty). The item is
+  // moved out of the ring and its slot destroyed.
   bool Receive(T* item);
 
+  // SendWait puts an item onto the channel, blocking while it is full
+  // in the way WaitStrategy dictates. Stats see one rejection however
+  // long it blocks.
+  void SendWait(const T &item) {
+    if (!Send(item)) {
+      writable_.Wait([&] { return !full(); });
+      Send(item);
+    }
+  }
+  void SendWait(T &&item) {
+    if (!Send(std::move(item))) {
+      writable_.Wait([&] { return !full(); });
+      Send(std::move(item));
+    }
+  }
+
+  // ReceiveWait takes an item from the channel, blocking while it is
+  // empty in the way WaitStrategy dictates. It returns false, without
+  // an item, once the channel is closed and drained. Stats see one
+  // rejection however long it blocks.
+  bool ReceiveWait(T* item) {
+    const ReceiveStatus status = TryReceive(item);
+    if (status != ReceiveStatus::kEmpty) {
+      return status == ReceiveStatus::kReceived;
+    }
+    readable_.Wait([&] { return !empty() || closed(); });
+    return !empty() && Receive(item);
+  }
+
+  // SendUntil is SendWait that gives up when the deadline passes. It
+  // returns whether it sent the item; the item is only moved from if it
+  // did. SendFor takes a timeout instead.
+  template <class Clock, class Duration>
+  bool SendUntil(const T &item,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    return Send(item) ||
+           (writable_.WaitUntil([&] { return !full(); }, deadline) &&
+            Send(item));
+  }
+  template <class Clock, class Duration>
+  bool SendUntil(T &&item,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    return Send(std::move(item)) ||
+           (writable_.WaitUntil([&] { return !full(); }, deadline) &&
+            Send(std::move(item)));
+  }
+  template <class Rep, class Period>
+  bool SendFor(const T &item,
+               const std::chrono::duration<Rep, Period> &timeout) {
+    return SendUntil(item, std::chrono::steady_clock::now() + timeout);
+  }
+  template <class Rep, class Period>
+  bool SendFor(T &&item, const std::chrono::duration<Rep, Period> &timeout) {
+    return SendUntil(std::move(item),
+                     std::chrono::steady_clock::now() + timeout);
+  }
+
+  // ReceiveUntil is ReceiveWait that gives up when the deadline passes.
+  // It returns false, without an item, on the deadline or once the
+  // channel is closed and drained; closed() tells which. ReceiveFor
+  // takes a timeout instead.
+  template <class Clock, class Duration>
+  bool ReceiveUntil(T* item,
+                    const std::chrono::time_point<Clock, Duration> &deadline) {
+    const ReceiveStatus status = TryReceive(item);
+    if (status != ReceiveStatus::kEmpty) {
+      return status == ReceiveStatus::kReceived;
+    }
+    return readable_.WaitUntil([&] { return !empty() || closed(); },
+                               deadline) &&
+           !empty() && Receive(item);
+  }
+  template <class Rep, class Period>
+  bool ReceiveFor(T* item, const std::chrono::duration<Rep, Period> &timeout) {
+    return ReceiveUntil(item, std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Close tells the receiver that nothing more will be sent, after the
+  // items already sent, which it publishes. The sender must not send
+  // after closing.
+  void Close() {
+    FlushSends();
+    closed_.store(true, std::memory_order_release); // after the writes
+    readable_.Notify();
+  }
+
+  // closed returns whether the sender has closed the channel. Once it
+  // has, a receive that finds nothing means the channel is drained.
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+  // full returns whether the sender would find no room. Only the sender
+  // may call it.
+  bool full() {
+    const Index w = SendCount();
+    if (Count(w, r_cache_) == ring_.capacity()) {
+      r_cache_ = r_.load(std::memory_order_acquire); // observe any reads
+    }
+    return Count(w, r_cache_) == ring_.capacity();
+  }
+
+  // empty returns whether the receiver would find nothing waiting. Only
+  // the receiver may call it.
+  bool empty() {
+    const Index r = ReceiveCount();
+    if (r == w_cache_) {
+      w_cache_ = w_.load(std::memory_order_acquire); // observe any writes
+    }
+    return r == w_cache_;
+  }
+
+  // The WaitStrategy instance that the receiver waits on and the sender
+  // notifies, for a Selector to attach to.
+  WaitStrategy& readable() { return readable_; }
+
+  // TryReceive is Receive that also tells an empty channel from one
+  // that is closed and drained.
+  ReceiveStatus TryReceive(T* item) {
+    if (Receive(item)) {
+      return ReceiveStatus::kReceived;
+    }
+    // Items sent before Close are visible once closed_ is. Look before
+    // receiving again, so a drained channel counts as empty only once.
+    if (!closed()) {
+      return ReceiveStatus::kEmpty;
+    }
+    if (empty()) {
+      return ReceiveStatus::kClosed;
+    }
+    return Receive(item) ? ReceiveStatus::kReceived : ReceiveStatus::kClosed;
+  }
+
+  // Iterating over a channel receives items with ReceiveWait until the
+  // channel is closed and drained:
+  //
+  //   for (Message &m : c) { ... }
+  class Iterator;
+  Iterator begin() { return Iterator(this); }
+  Iterator end() { return Iterator(nullptr); }
+
+  // SendN puts up to n items onto the channel and returns how many it
+  // put. The write index is published once for the whole batch.
+  int SendN(const T *items, int n);
+
+  // ReceiveN takes up to n items from the channel into items and
+  // returns how many it took. The read index is published once for the
+  // whole batch.
+  int ReceiveN(T* items, int n);
+
+  // Reserve lets the sender build items in place. It returns how many
+  // free slots, up to n, follow *slots contiguously in the ring; fewer
+  // than n are returned at the end of the ring or when the channel is
+  // nearly full. The slots are raw storage: construct each item with
+  // placement new. The receiver sees nothing until Commit.
+  int Reserve(int n, T** slots);
+
+  // Commit publishes the first n slots from the last Reserve.
+  void Commit(int n);
+
+  // Peek lets the receiver use items in place. It returns how many
+  // items, up to n, follow *items contiguously in the ring. The slots
+  // stay owned by the receiver until Release.
+  int Peek(int n, T** items);
+
+  // Release destroys the first n items from the last Peek and hands
+  // their slots back to the sender.
+  void Release(int n);
+
+  // By default each side publishes its index after every operation,
+  // which costs the other side a cache miss per operation. With
+  // PublishBatched and a batch of k, the sender only publishes once k
+  // items are pending, or when the channel may be full; the receiver
+  // likewise hands slots back once k are pending, or when it has taken
+  // everything it knows of. Items sent in the meantime are delayed, so
+  // a batching sender should FlushSends when it runs out of work, and a
+  // batching receiver should FlushReceives before it stops receiving.
+  // SetSendBatch and FlushSends are only for the sender;
+  // SetReceiveBatch and FlushReceives only for the receiver. The
+  // batches start at 1.
+  void SetSendBatch(int k) {
+    static_assert(Publish::kBatched, "SetSendBatch needs PublishBatched");
+    assert(k > 0);
+    send_batch_ = k;
+  }
+  void SetReceiveBatch(int k) {
+    static_assert(Publish::kBatched, "SetReceiveBatch needs PublishBatched");
+    assert(k > 0);
+    receive_batch_ = k;
+  }
+
+  // FlushSends publishes every item sent so far. Without batching
+  // there is never anything to publish.
+  void FlushSends() {
+    if (Publish::kBatched &&
+        w_next_ != w_.load(std::memory_order_relaxed)) { // we own w_
+      w_.store(w_next_, std::memory_order_release); // publish the writes
+      readable_.Notify();
+    }
+  }
+
+  // FlushReceives hands back the slots of every item received so far.
+  void FlushReceives() {
+    if (Publish::kBatched &&
+        r_next_ != r_.load(std::memory_order_relaxed)) { // we own r_
+      r_.store(r_next_, std::memory_order_release); // publish the reads
+      writable_.Notify();
+    }
+  }
+
 private:
-  int cap_, size_, size_mask_;
-  T *buf_;
+  // MoveOut moves n items starting at slot i into out, destroying them.
+  void MoveOut(int i, int n, T* out) {
+    for (int k = 0; k < n; ++k) {
+      out[k] = std::move(*ring_.slot(i+k));
+      ring_.slot(i+k)->~T();
+    }
+  }
+
+  // The number of items between r and w.
+  static int Count(Index w, Index r) {
+    return static_cast<int>(static_cast<Index>(w - r));
+  }
+
+  // Writable returns how many of n items fit after w, refreshing
+  // r_cache_ if the cached view is not enough.
+  int Writable(Index w, int n);
+
+  // Readable returns how many of n items are waiting at r, refreshing
+  // w_cache_ if the cached view is not enough.
+  int Readable(Index r, int n);
+
+  // The number of items the sender has sent and the receiver has
+  // received, published or not.
+  Index SendCount() const {
+    return Publish::kBatched ? w_next_
+                             : w_.load(std::memory_order_relaxed); // we own w_
+  }
+  Index ReceiveCount() const {
+    return Publish::kBatched ? r_next_
+                             : r_.load(std::memory_order_relaxed); // we own r_
+  }
+
+  // Advance the sender's or receiver's count from w or r by n,
+  // publishing it as Publish dictates.
+  void Sent(Index w, int n) {
+    stats_.Sent(w_pos_, n);
+    w_pos_ = ring_.Wrap(w_pos_ + n);
+    if (!Publish::kBatched) {
+      w_.store(w+n, std::memory_order_release); // publish the writes
+      readable_.Notify();
+      return;
+    }
+    w_next_ = w + n;
+    if (Count(w_next_, w_.load(std::memory_order_relaxed)) >= send_batch_ ||
+        Count(w_next_, r_cache_) == ring_.capacity()) {
+      FlushSends();
+    }
+  }
+  void Received(Index r, int n) {
+    stats_.Received(r_pos_, n);
+    r_pos_ = ring_.Wrap(r_pos_ + n);
+    if (!Publish::kBatched) {
+      r_.store(r+n, std::memory_order_release); // publish the reads
+      writable_.Notify();
+      return;
+    }
+    r_next_ = r + n;
+    if (Count(r_next_, r_.load(std::memory_order_relaxed)) >= receive_batch_ ||
+        r_next_ == w_cache_) {
+      FlushReceives();
+    }
+  }
+
+  // Read-only after construction.
+  alignas(kCacheLineSize) channel_internal::Ring<T, N> ring_;
+
+  // The receive and send counts count every item ever received and
+  // sent; they are never masked, so their difference is the number of
+  // items in the channel and a full channel needs no spare slot. r_ and
+  // w_ are the published counts. With PublishBatched each side keeps
+  // its own count in r_next_ or w_next_, ahead of r_ or w_ by up to a
+  // batch; otherwise r_next_, w_next_ and the batches are unused. Each
+  // side tracks the slot its count points at in r_pos_ or w_pos_.
+
+  // Owned by the receiver. w_cache_ is the receiver's last view of w_;
+  // it is only refreshed when the channel looks empty.
+  alignas(kCacheLineSize) std::atomic<Index> r_;
+  Index r_next_;
+  Index w_cache_;
+  int r_pos_;
+  int receive_batch_;
 
-  std::atomic<int> r_, w_;
+  // Owned by the sender. r_cache_ is the sender's last view of r_; it
+  // is only refreshed when the channel looks full.
+  alignas(kCacheLineSize) std::atomic<Index> w_;
+  Index w_next_;
+  Index r_cache_;
+  int w_pos_;
+  int send_batch_;
+  std::atomic<bool> closed_;
+
+  // The receiver parks on readable_ and the sender on writable_; each
+  // side notifies the other after publishing its index.
+  alignas(kCacheLineSize) WaitStrategy readable_;
+  alignas(kCacheLineSize) WaitStrategy writable_;
+
+  // Stats that record something get a cache line of their own; an empty
+  // one fits in the padding above.
+  alignas(std::is_empty<Stats>::value ? alignof(Stats) : kCacheLineSize)
+      Stats stats_;
 };
 
-template <class T>
-bool Channel<T>::Send(const T &item) {
-  const int w = w_.load(std::memory_order_relaxed); // we own w_
-  const int r = r_.load(std::memory_order_acquire); // observe any reads
-  const int nitems = w - r;
-  if (nitems == cap_ || nitems + size_ == cap_) {
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+class Channel<T, N, WaitStrategy, Index, Stats, Publish>::Iterator {
+public:
+  // A null channel makes the end iterator, which holds no item.
+  explicit Iterator(Channel* c) : c_(c) { Next(); }
+
+  T& operator*() { return *item_; }
+  T* operator->() { return &*item_; }
+  Iterator& operator++() {
+    Next();
+    return *this;
+  }
+  bool operator==(const Iterator &other) const { return c_ == other.c_; }
+  bool operator!=(const Iterator &other) const { return c_ != other.c_; }
+
+private:
+  // Next receives the next item, or becomes the end iterator once the
+  // channel is closed and drained. The item is moved straight out of
+  // its slot into item_, so T need not be default-constructible. Like
+  // ReceiveWait, it shows Stats one rejection however long it blocks.
+  void Next() {
+    item_.reset();
+    if (c_ == nullptr) {
+      return;
+    }
+    T* slot;
+    if (c_->Peek(1, &slot) == 0) {
+      c_->readable_.Wait([&] { return !c_->empty() || c_->closed(); });
+      if (c_->empty()) {
+        c_ = nullptr;
+        return;
+      }
+      c_->Peek(1, &slot);
+    }
+    item_.emplace(std::move(*slot));
+    c_->Release(1);
+  }
+
+  Channel *c_;
+  std::optional<T> item_;
+};
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+template <class... Args>
+bool Channel<T, N, WaitStrategy, Index, Stats, Publish>::Emplace(
+    Args&&... args) {
+  const Index w = SendCount();
+  if (Count(w, r_cache_) == ring_.capacity()) {
+    r_cache_ = r_.load(std::memory_order_acquire); // observe any reads
+    if (Count(w, r_cache_) == ring_.capacity()) {
+      stats_.SendFull();
+      return false;
+    }
+  }
+  new (ring_.slot(w_pos_)) T(std::forward<Args>(args)...);
+  Sent(w, 1);
+  return true;
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+bool Channel<T, N, WaitStrategy, Index, Stats, Publish>::Receive(T* item) {
+  const Index r = ReceiveCount();
+  if (r == w_cache_) {
+    w_cache_ = w_.load(std::memory_order_acquire); // observe any writes
+    stats_.Waiting(Count(w_cache_, r));
+    if (r == w_cache_) {
+      stats_.ReceiveEmpty();
+      return false;
+    }
+  }
+  MoveOut(r_pos_, 1, item);
+  Received(r, 1);
+  return true;
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+int Channel<T, N, WaitStrategy, Index, Stats, Publish>::Writable(
+    Index w, int n) {
+  int space = ring_.capacity() - Count(w, r_cache_);
+  if (space < n) {
+    r_cache_ = r_.load(std::memory_order_acquire); // observe any reads
+    space = ring_.capacity() - Count(w, r_cache_);
+    if (space == 0) {
+      stats_.SendFull();
+    }
+  }
+  return std::min(n, space);
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+int Channel<T, N, WaitStrategy, Index, Stats, Publish>::Readable(
+    Index r, int n) {
+  int avail = Count(w_cache_, r);
+  if (avail < n) {
+    w_cache_ = w_.load(std::memory_order_acquire); // observe any writes
+    avail = Count(w_cache_, r);
+    stats_.Waiting(avail);
+    if (avail == 0) {
+      stats_.ReceiveEmpty();
+    }
+  }
+  return std::min(n, avail);
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+int Channel<T, N, WaitStrategy, Index, Stats, Publish>::SendN(
+    const T *items, int n) {
+  const Index w = SendCount();
+  n = Writable(w, n);
+  if (n <= 0) {
+    return 0;
+  }
+  // The free slots may wrap around the end of the ring.
+  const int first = std::min(n, ring_.size() - w_pos_);
+  std::uninitialized_copy(items, items + first, ring_.slot(w_pos_));
+  std::uninitialized_copy(items + first, items + n, ring_.slot(0));
+  Sent(w, n);
+  return n;
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+int Channel<T, N, WaitStrategy, Index, Stats, Publish>::ReceiveN(
+    T* items, int n) {
+  const Index r = ReceiveCount();
+  n = Readable(r, n);
+  if (n <= 0) {
+    return 0;
+  }
+  // The filled slots may wrap around the end of the ring.
+  const int first = std::min(n, ring_.size() - r_pos_);
+  MoveOut(r_pos_, first, items);
+  MoveOut(0, n - first, items + first);
+  Received(r, n);
+  return n;
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+int Channel<T, N, WaitStrategy, Index, Stats, Publish>::Reserve(
+    int n, T** slots) {
+  *slots = ring_.slot(w_pos_);
+  return std::min(Writable(SendCount(), n), ring_.size() - w_pos_);
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+void Channel<T, N, WaitStrategy, Index, Stats, Publish>::Commit(int n) {
+  Sent(SendCount(), n);
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+int Channel<T, N, WaitStrategy, Index, Stats, Publish>::Peek(int n, T** items) {
+  *items = ring_.slot(r_pos_);
+  return std::min(Readable(ReceiveCount(), n), ring_.size() - r_pos_);
+}
+
+template <class T, int N, class WaitStrategy, class Index, class Stats,
+          class Publish>
+void Channel<T, N, WaitStrategy, Index, Stats, Publish>::Release(int n) {
+  for (int k = 0; k < n; ++k) {
+    ring_.slot(r_pos_+k)->~T();
+  }
+  Received(ReceiveCount(), n);
+}
+
+// Channel<T, 0> has no slots: a Send only succeeds while the receiver
+// is blocked in ReceiveWait or ReceiveUntil, and a Receive only while
+// the sender is blocked in SendWait or SendUntil, and the item is
+// assigned straight from the sender's variable into the receiver's. It
+// suits request/response between two threads that would otherwise
+// bounce every item through a one-slot ring. There is no batching,
+// Reserve or Peek. Each side records the hand-off in its own Stats
+// calls, at the same time as the other, so Stats must have separate
+// sides: NoStats or CounterStats, not LatencyStats.
+//
+// A side that blocks first offers its end of the hand-off: the receiver
+// its destination in dest_, moving state_ from kIdle to kWaiting, or
+// the sender its item in src_, moving state_ from kIdle to kOffered.
+// The other side claims the offer by moving state_ to kBusy, assigns
+// the item and sets kIdle again. A side withdraws an offer by moving
+// state_ back to kIdle; if the other side has claimed it first, it
+// waits out the assignment. Only a blocked side ever waits, so Send and
+// Receive that find nothing to claim write nothing and wake no one.
+template <class T, class WaitStrategy, class Index, class Stats,
+          class Publish>
+class Channel<T, 0, WaitStrategy, Index, Stats, Publish> {
+  static_assert(std::atomic<int>::is_always_lock_free,
+                "No guarantee that Channel is lock-free on this platform");
+  static_assert(Stats::kSeparateSides,
+                "A rendezvous needs Stats whose sides share no state");
+
+public:
+  Channel()
+      : dest_(nullptr), src_(nullptr), assign_(nullptr), state_(kIdle),
+        stats_(1) {}
+  explicit Channel(int capacity) : Channel() {
+    assert(capacity == 0);
+    (void)capacity;
+  }
+
+  // Always 0.
+  int capacity() const { return 0; }
+
+  // The Stats policy instance. It sees every hand-off in slot 0.
+  const Stats& stats() const { return stats_; }
+
+  // Send hands the item to the receiver if it is waiting right now. It
+  // returns true if it did. The item is only moved from on success.
+  bool Send(const T &item) { return Sent(Hand(item)); }
+  bool Send(T &&item) { return Sent(Hand(std::move(item))); }
+
+  // Receive takes the sender's item if it is waiting right now. It
+  // returns true if it did.
+  bool Receive(T* item) { return Received(Take(item)); }
+
+  // SendWait blocks until the receiver takes the item.
+  void SendWait(const T &item) {
+    Put(item, [&](auto ready) {
+      writable_.Wait(ready);
+      return true;
+    });
+  }
+  void SendWait(T &&item) {
+    Put(std::move(item), [&](auto ready) {
+      writable_.Wait(ready);
+      return true;
+    });
+  }
+
+  // ReceiveWait blocks until a sender hands over an item. A rendezvous
+  // cannot be closed, so it always returns true, like ReceiveWait on an
+  // open buffered Channel.
+  bool ReceiveWait(T* item) {
+    return Get(item, [&](auto ready) {
+      readable_.Wait(ready);
+      return true;
+    });
+  }
+
+  // SendUntil, SendFor, ReceiveUntil and ReceiveFor give up when the
+  // deadline passes, as for the buffered Channel.
+  template <class Clock, class Duration>
+  bool SendUntil(const T &item,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    return Put(item, [&](auto ready) {
+      return writable_.WaitUntil(ready, deadline);
+    });
+  }
+  template <class Clock, class Duration>
+  bool SendUntil(T &&item,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    return Put(std::move(item), [&](auto ready) {
+      return writable_.WaitUntil(ready, deadline);
+    });
+  }
+  template <class Rep, class Period>
+  bool SendFor(const T &item,
+               const std::chrono::duration<Rep, Period> &timeout) {
+    return SendUntil(item, std::chrono::steady_clock::now() + timeout);
+  }
+  template <class Rep, class Period>
+  bool SendFor(T &&item, const std::chrono::duration<Rep, Period> &timeout) {
+    return SendUntil(std::move(item),
+                     std::chrono::steady_clock::now() + timeout);
+  }
+  template <class Clock, class Duration>
+  bool ReceiveUntil(T* item,
+                    const std::chrono::time_point<Clock, Duration> &deadline) {
+    return Get(item, [&](auto ready) {
+      return readable_.WaitUntil(ready, deadline);
+    });
+  }
+  template <class Rep, class Period>
+  bool ReceiveFor(T* item, const std::chrono::duration<Rep, Period> &timeout) {
+    return ReceiveUntil(item, std::chrono::steady_clock::now() + timeout);
+  }
+
+private:
+  enum State { kIdle, kWaiting, kOffered, kBusy };
+
+  // Hand assigns item to the waiting receiver, if any.
+  template <class U>
+  bool Hand(U&& item);
+
+  // Take assigns the waiting sender's item to *item, if any.
+  bool Take(T* item);
+
+  // Put hands item over, offering it if the receiver is not waiting
+  // yet, and then blocks with block(ready), which returns false if it
+  // gave up before ready() was true. It returns whether it handed the
+  // item over.
+  template <class U, class Block>
+  bool Put(U&& item, Block block);
+
+  // Get is Put for the receiver.
+  template <class Block>
+  bool Get(T* item, Block block);
+
+  // Assign assigns *src to *dest as Put was given it, moving from it
+  // only if it was an rvalue.
+  template <class U>
+  static void Assign(const T* src, T* dest) {
+    *dest = std::forward<U>(
+        *const_cast<typename std::remove_reference<U>::type*>(src));
+  }
+
+  // Offer publishes this side's end of the hand-off by moving state_
+  // from kIdle to offer. It fails if the other side offered first.
+  bool Offer(State offer) {
+    int idle = kIdle;
+    return state_.compare_exchange_strong(idle, offer,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed);
+  }
+
+  // Done returns whether the other side has finished with an offer.
+  bool Done(State offer) const {
+    const int state = state_.load(std::memory_order_acquire);
+    return state != offer && state != kBusy;
+  }
+
+  // Withdraw takes back an offer, unless the other side has claimed it,
+  // in which case it waits out the assignment. It returns whether the
+  // hand-off happened.
+  bool Withdraw(State offer) {
+    int offered = offer;
+    if (state_.compare_exchange_strong(offered, kIdle,
+                                       std::memory_order_relaxed)) {
+      return false;
+    }
+    while (!Done(offer)) {
+      channel_internal::CpuRelax();
+    }
+    return true;
+  }
+
+  bool Sent(bool ok) {
+    if (ok) {
+      stats_.Sent(0, 1);
+    } else {
+      stats_.SendFull();
+    }
+    return ok;
+  }
+  bool Received(bool ok) {
+    if (ok) {
+      stats_.Received(0, 1);
+    } else {
+      stats_.ReceiveEmpty();
+    }
+    return ok;
+  }
+
+  // Written by the receiver while state_ is kIdle and read by the
+  // sender once it has claimed the offer.
+  T* dest_;
+
+  // Written by the sender while state_ is kIdle and read by the
+  // receiver once it has claimed the offer, along with how to assign it.
+  const T* src_;
+  void (*assign_)(const T* src, T* dest);
+
+  alignas(kCacheLineSize) std::atomic<int> state_;
+
+  // The receiver parks on readable_ while it has an offer out, and the
+  // sender on writable_.
+  alignas(kCacheLineSize) WaitStrategy readable_;
+  alignas(kCacheLineSize) WaitStrategy writable_;
+
+  alignas(std::is_empty<Stats>::value ? alignof(Stats) : kCacheLineSize)
+      Stats stats_;
+};
+
+template <class T, class WaitStrategy, class Index, class Stats,
+          class Publish>
+template <class U>
+bool Channel<T, 0, WaitStrategy, Index, Stats, Publish>::Hand(U&& item) {
+  int waiting = kWaiting;
+  if (!state_.compare_exchange_strong(waiting, kBusy,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
     return false;
   }
-  buf_[w] = item;
-  w_.store((w+1) & size_mask_, std::memory_order_release); // publish the write
+  *dest_ = std::forward<U>(item);
+  state_.store(kIdle, std::memory_order_release); // publish the item
+  readable_.Notify();
   return true;
 }
 
-template <class T>
-bool Channel<T>::Receive(T* item) {
-  const int r = r_.load(std::memory_order_relaxed); // we own r_
-  const int w = w_.load(std::memory_order_acquire); // observe any writes
-  if (r == w) {
+template <class T, class WaitStrategy, class Index, class Stats,
+          class Publish>
+bool Channel<T, 0, WaitStrategy, Index, Stats, Publish>::Take(T* item) {
+  int offered = kOffered;
+  if (!state_.compare_exchange_strong(offered, kBusy,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
+    return false;
+  }
+  assign_(src_, item);
+  state_.store(kIdle, std::memory_order_release); // done with src_
+  writable_.Notify();
+  return true;
+}
+
+template <class T, class WaitStrategy, class Index, class Stats,
+          class Publish>
+template <class U, class Block>
+bool Channel<T, 0, WaitStrategy, Index, Stats, Publish>::Put(U&& item,
+                                                             Block block) {
+  if (Hand(std::forward<U>(item))) {
+    stats_.Sent(0, 1);
+    return true;
+  }
+  stats_.SendFull(); // once, however long we wait
+  // The receiver either is waiting, so Hand succeeds, or is not, so
+  // Offer does, unless the receiver offered in between.
+  for (;;) {
+    src_ = &item;
+    assign_ = &Assign<U>;
+    if (Offer(kOffered)) {
+      break;
+    }
+    if (Hand(std::forward<U>(item))) {
+      stats_.Sent(0, 1);
+      return true;
+    }
+  }
+  if (!block([&] { return Done(kOffered); }) && !Withdraw(kOffered)) {
+    return false;
+  }
+  stats_.Sent(0, 1);
+  return true;
+}
+
+template <class T, class WaitStrategy, class Index, class Stats,
+          class Publish>
+template <class Block>
+bool Channel<T, 0, WaitStrategy, Index, Stats, Publish>::Get(T* item,
+                                                             Block block) {
+  if (Take(item)) {
+    stats_.Received(0, 1);
+    return true;
+  }
+  stats_.ReceiveEmpty(); // once, however long we wait
+  for (;;) {
+    dest_ = item;
+    if (Offer(kWaiting)) {
+      break;
+    }
+    if (Take(item)) {
+      stats_.Received(0, 1);
+      return true;
+    }
+  }
+  if (!block([&] { return Done(kWaiting); }) && !Withdraw(kWaiting)) {
     return false;
   }
-  *item = buf_[r];
-  r_.store((r+1) & size_mask_, std::memory_order_release); // publish the read
+  stats_.Received(0, 1);
   return true;
 }
 
@@ -0,0 +1,247 @@
+// Stats policies for Channel. Pass one as Channel's Stats parameter and
+// read it from any thread through Channel::stats().
+
+#ifndef CHANNEL_STATS_H
+#define CHANNEL_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "channel.h"
+
+namespace channel_internal {
+
+// Ticks returns a cheap timestamp: the TSC on x86, otherwise
+// nanoseconds from the steady clock.
+inline uint64_t Ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+}  // namespace channel_internal
+
+// TicksPerNanosecond measures, once, how fast Ticks advances, for
+// converting the values in a LatencyHistogram.
+inline double TicksPerNanosecond() {
+  static const double ratio = [] {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point begin = Clock::now();
+    const uint64_t ticks = channel_internal::Ticks();
+    while (Clock::now() - begin < std::chrono::milliseconds(10)) {
+    }
+    const uint64_t elapsed_ticks = channel_internal::Ticks() - ticks;
+    const std::chrono::duration<double, std::nano> elapsed =
+        Clock::now() - begin;
+    return elapsed_ticks / elapsed.count();
+  }();
+  return ratio;
+}
+
+// LatencyHistogram counts values in log-linear buckets, like an HDR
+// histogram: each power of 2 is split into 16 buckets, so a bucket's
+// bounds are within about 6% of each other. One thread records; any
+// thread may take a Snapshot.
+class LatencyHistogram {
+public:
+  static const int kSubBits = 4;
+  static const int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  LatencyHistogram() {
+    for (auto &count : counts_) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Record counts one value. Only one thread may call it.
+  void Record(uint64_t value) {
+    std::atomic<uint64_t> &count = counts_[Bucket(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
+
+  // A Snapshot is a copy of the counts at one moment.
+  struct Snapshot {
+    uint64_t counts[kBuckets];
+    uint64_t total;
+
+    // Percentile returns the lower bound of the bucket holding the p-th
+    // percentile value, for p in [0, 100], or 0 if nothing was recorded.
+    uint64_t Percentile(double p) const {
+      uint64_t seen = 0;
+      const double want = total * p / 100;
+      for (int b = 0; b < kBuckets; ++b) {
+        seen += counts[b];
+        if (seen > 0 && seen >= want) {
+          return LowerBound(b);
+        }
+      }
+      return 0;
+    }
+  };
+
+  Snapshot Take() const {
+    Snapshot s;
+    s.total = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+      s.counts[b] = counts_[b].load(std::memory_order_relaxed);
+      s.total += s.counts[b];
+    }
+    return s;
+  }
+
+  // Bucket returns the bucket a value falls in.
+  static int Bucket(uint64_t value) {
+    if (value < (1u << kSubBits)) {
+      return static_cast<int>(value);
+    }
+    const int top = 63 - __builtin_clzll(value);
+    const int sub = (value >> (top - kSubBits)) & ((1 << kSubBits) - 1);
+    return ((top - kSubBits + 1) << kSubBits) + sub;
+  }
+
+  // LowerBound returns the smallest value in bucket b.
+  static uint64_t LowerBound(int b) {
+    const int group = b >> kSubBits;
+    const uint64_t sub = b & ((1 << kSubBits) - 1);
+    if (group == 0) {
+      return sub;
+    }
+    return ((uint64_t(1) << kSubBits) + sub) << (group - 1);
+  }
+
+private:
+  std::atomic<uint64_t> counts_[kBuckets];
+};
+
+// CounterStats counts each side's successes and failures, for sizing a
+// channel and placing its threads. Each side's counters are on their
+// own cache line and written only by that side, with plain loads and
+// stores, so counting adds no atomic read-modify-writes and no sharing
+// to the hot path. Any thread may read them with counts().
+class CounterStats {
+public:
+  static constexpr bool kSeparateSides = true;
+
+  explicit CounterStats(int) {}
+
+  // Counts is a copy of the counters. An attempt is a call to one of
+  // the Send or Receive methods, or to Reserve or Peek; it either
+  // succeeds, moving one or more items, or is rejected because the
+  // channel is full or empty. A blocking call that finds the channel
+  // full or empty is rejected once, however long it then waits, and
+  // counts again when it succeeds, so send_full and receive_empty tell
+  // how often the channel was full or empty, not how long.
+  struct Counts {
+    uint64_t send_attempts, sends, items_sent, send_full;
+    uint64_t receive_attempts, receives, items_received, receive_empty;
+    // The most items the receiver has found in the channel. It is only
+    // sampled when the receiver reloads the write index, once the items
+    // it already knew of run short, so the true peak occupancy may be
+    // higher.
+    int peak_waiting;
+  };
+
+  Counts counts() const {
+    Counts c;
+    c.sends = sender_.calls.load(std::memory_order_relaxed);
+    c.items_sent = sender_.items.load(std::memory_order_relaxed);
+    c.send_full = sender_.rejected.load(std::memory_order_relaxed);
+    c.send_attempts = c.sends + c.send_full;
+    c.receives = receiver_.calls.load(std::memory_order_relaxed);
+    c.items_received = receiver_.items.load(std::memory_order_relaxed);
+    c.receive_empty = receiver_.rejected.load(std::memory_order_relaxed);
+    c.receive_attempts = c.receives + c.receive_empty;
+    c.peak_waiting = static_cast<int>(
+        receiver_.peak.load(std::memory_order_relaxed));
+    return c;
+  }
+
+  void Sent(int, int n) {
+    Add(&sender_.calls, 1);
+    Add(&sender_.items, n);
+  }
+  void Received(int, int n) {
+    Add(&receiver_.calls, 1);
+    Add(&receiver_.items, n);
+  }
+  void SendFull() { Add(&sender_.rejected, 1); }
+  void ReceiveEmpty() { Add(&receiver_.rejected, 1); }
+  void Waiting(int n) {
+    if (static_cast<uint64_t>(n) >
+        receiver_.peak.load(std::memory_order_relaxed)) {
+      receiver_.peak.store(n, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  struct Side {
+    std::atomic<uint64_t> calls{0}, items{0}, rejected{0}, peak{0};
+  };
+
+  // Add is an increment by the counter's only writer, so it needs no
+  // read-modify-write; readers may just see the previous value.
+  static void Add(std::atomic<uint64_t>* counter, uint64_t n) {
+    counter->store(counter->load(std::memory_order_relaxed) + n,
+                   std::memory_order_relaxed);
+  }
+
+  alignas(kCacheLineSize) Side sender_;
+  alignas(kCacheLineSize) Side receiver_;
+};
+
+// LatencyStats records how long each item waits in the channel. Send
+// stamps the item's slot with Ticks() and Receive records the time
+// since the stamp in a LatencyHistogram, in ticks; divide by
+// TicksPerNanosecond() for nanoseconds. For Peek/Release the wait ends
+// at Release.
+class LatencyStats {
+public:
+  // The receiver reads the stamps the sender writes.
+  static constexpr bool kSeparateSides = false;
+
+  explicit LatencyStats(int slots)
+      : slots_(slots), stamps_(new uint64_t[slots]) {}
+
+  void Sent(int pos, int n) {
+    const uint64_t now = channel_internal::Ticks();
+    for (int i = 0; i < n; ++i) {
+      stamps_[Wrap(pos + i)] = now;
+    }
+  }
+
+  void Received(int pos, int n) {
+    const uint64_t now = channel_internal::Ticks();
+    for (int i = 0; i < n; ++i) {
+      latency_.Record(now - stamps_[Wrap(pos + i)]);
+    }
+  }
+
+  void SendFull() {}
+  void ReceiveEmpty() {}
+  void Waiting(int) {}
+
+  // The queueing delays recorded so far.
+  LatencyHistogram::Snapshot latency() const { return latency_.Take(); }
+
+private:
+  int Wrap(int pos) const { return pos >= slots_ ? pos - slots_ : pos; }
+
+  // The sender writes a slot's stamp before publishing the slot and
+  // the receiver reads it before releasing the slot, so the channel's
+  // own ordering protects the stamps.
+  int slots_;
+  std::unique_ptr<uint64_t[]> stamps_;
+  LatencyHistogram latency_;
+};
+
+#endif  // CHANNEL_STATS_H
@@ -0,0 +1,214 @@
+// FanIn merges many senders into one receiver without a contended
+// queue. Each sender gets its own lane, a Channel it sends on wait-free
+// as usual, and the receiver takes from the lanes in weighted
+// round-robin order through one Receive. A bitmap of lanes that may
+// have items lets the receiver skip idle lanes 64 at a time instead of
+// looking at every lane.
+
+#ifndef FAN_IN_H
+#define FAN_IN_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "channel.h"
+
+// Each lane is a Channel<T, N, WaitStrategy> holding N items, or the
+// capacity passed to the constructor. WaitStrategy is also how
+// ReceiveWait waits for any lane to have an item.
+template <class T, int N = kDynamicCapacity, class WaitStrategy = BusySpin>
+class FanIn {
+public:
+  typedef Channel<T, N, WaitStrategy> Lane;
+
+  // Create a FanIn with the given number of lanes, each holding
+  // capacity items.
+  FanIn(int lanes, int capacity);
+
+  // Create a FanIn whose lanes have the compile-time capacity N.
+  explicit FanIn(int lanes) : FanIn(lanes, N) {
+    static_assert(N != kDynamicCapacity, "FanIn needs a capacity");
+  }
+
+  // The number of lanes.
+  int lanes() const { return static_cast<int>(lanes_.size()); }
+
+  // Send attempts to put an item onto a lane. Each lane must have only
+  // one sending thread. It returns true if it succeeded (the lane was
+  // not already full). The item is only moved from on success.
+  bool Send(int lane, const T &item) {
+    return Marked(lane, Of(lane).Send(item));
+  }
+  bool Send(int lane, T &&item) {
+    return Marked(lane, Of(lane).Send(std::move(item)));
+  }
+
+  // SendN puts up to n items onto a lane and returns how many it put.
+  int SendN(int lane, const T *items, int n) {
+    return Marked(lane, Of(lane).SendN(items, n));
+  }
+
+  // SendWait puts an item onto a lane, blocking while it is full in the
+  // way WaitStrategy dictates.
+  void SendWait(int lane, const T &item) {
+    Of(lane).SendWait(item);
+    Marked(lane, 1);
+  }
+  void SendWait(int lane, T &&item) {
+    Of(lane).SendWait(std::move(item));
+    Marked(lane, 1);
+  }
+
+  // SetWeight lets the receiver take up to weight items in a row from a
+  // lane before moving on to the next. Every lane starts with weight 1,
+  // which is plain round robin. Only the receiver may call it.
+  void SetWeight(int lane, int weight) {
+    assert(weight > 0);
+    weights_[lane] = weight;
+  }
+
+  // Receive attempts to take an item from the next lane in turn. It
+  // returns true if it succeeded (some lane had an item).
+  bool Receive(T* item) { return ReceiveN(item, 1) == 1; }
+
+  // ReceiveN takes up to n items, visiting the lanes in turn, and
+  // returns how many it took.
+  int ReceiveN(T* items, int n);
+
+  // ReceiveWait takes an item, blocking while every lane is empty in
+  // the way WaitStrategy dictates.
+  void ReceiveWait(T* item) {
+    readable_.Wait([&] { return Receive(item); });
+  }
+
+private:
+  static const int kBits = 64;
+
+  // The summary is allocated in whole cache lines, so that it shares
+  // them with nothing else.
+  struct alignas(kCacheLineSize) SummaryLine {
+    static const int kWords = kCacheLineSize / sizeof(uint64_t);
+    std::atomic<uint64_t> words[kWords];
+  };
+
+  Lane& Of(int lane) { return *lanes_[lane]; }
+
+  // Word returns word w of the summary.
+  std::atomic<uint64_t>& Word(int w) {
+    return summary_[w / SummaryLine::kWords].words[w % SummaryLine::kWords];
+  }
+
+  // Marked sets the lane's bit in the summary if n items were sent, and
+  // returns n. The bit is only written when it is clear, so a busy
+  // lane's sender just reads the summary.
+  int Marked(int lane, int n);
+
+  // NextLane makes the next lane after lane_ with items the current
+  // one, clearing the bits of lanes it finds empty. It returns false if
+  // every lane is empty.
+  bool NextLane();
+
+  // Read-only after construction, and read by every sender. The lanes
+  // are each on their own allocation so that their cache lines are
+  // apart. Bit i of Word(i / 64) is set while lane i may have items;
+  // senders set bits and the receiver clears them.
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  std::unique_ptr<SummaryLine[]> summary_;
+  int words_;
+
+  // Owned by the receiver. It is taking from lane_, and may take quota_
+  // more items from it before moving on.
+  alignas(kCacheLineSize) std::vector<int> weights_;
+  int lane_;
+  int quota_;
+
+  // The receiver waits on readable_ and a sender notifies it when it
+  // sets a bit.
+  alignas(kCacheLineSize) WaitStrategy readable_;
+};
+
+template <class T, int N, class WaitStrategy>
+FanIn<T, N, WaitStrategy>::FanIn(int lanes, int capacity)
+    : words_((lanes + kBits - 1) / kBits), weights_(lanes, 1),
+      lane_(lanes - 1), quota_(0) {
+  assert(lanes > 0);
+  for (int i = 0; i < lanes; ++i) {
+    lanes_.emplace_back(new Lane(capacity));
+  }
+  const int lines = (words_ + SummaryLine::kWords - 1) / SummaryLine::kWords;
+  summary_.reset(new SummaryLine[lines]);
+  for (int i = 0; i < lines * SummaryLine::kWords; ++i) {
+    Word(i).store(0, std::memory_order_relaxed);
+  }
+}
+
+template <class T, int N, class WaitStrategy>
+int FanIn<T, N, WaitStrategy>::Marked(int lane, int n) {
+  if (n <= 0) {
+    return n;
+  }
+  // Either the receiver sees the items when it rechecks the lane after
+  // clearing its bit, or we see the bit clear and set it again.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  std::atomic<uint64_t> &word = Word(lane / kBits);
+  const uint64_t bit = uint64_t(1) << (lane % kBits);
+  if ((word.load(std::memory_order_relaxed) & bit) == 0) {
+    word.fetch_or(bit, std::memory_order_relaxed);
+    readable_.Notify();
+  }
+  return n;
+}
+
+template <class T, int N, class WaitStrategy>
+bool FanIn<T, N, WaitStrategy>::NextLane() {
+  // Look at the bits after lane_ first and wrap around to lane_ itself.
+  const int start = lane_ + 1 == lanes() ? 0 : lane_ + 1;
+  const int first = start / kBits;
+  const uint64_t after = ~uint64_t(0) << (start % kBits);
+  for (int k = 0; k <= words_; ++k) {
+    const int w = (first + k) % words_;
+    uint64_t bits = Word(w).load(std::memory_order_relaxed);
+    if (k == 0) {
+      bits &= after;
+    } else if (k == words_) {
+      bits &= ~after;
+    }
+    for (; bits != 0; bits &= bits - 1) {
+      const int i = w * kBits + __builtin_ctzll(bits);
+      if (Of(i).empty()) {
+        const uint64_t bit = uint64_t(1) << (i % kBits);
+        Word(w).fetch_and(~bit, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (Of(i).empty()) {
+          continue;
+        }
+        Word(w).fetch_or(bit, std::memory_order_relaxed);
+      }
+      lane_ = i;
+      quota_ = weights_[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+template <class T, int N, class WaitStrategy>
+int FanIn<T, N, WaitStrategy>::ReceiveN(T* items, int n) {
+  int got = 0;
+  while (got < n) {
+    if ((quota_ == 0 || Of(lane_).empty()) && !NextLane()) {
+      break;
+    }
+    const int k = Of(lane_).ReceiveN(items + got, std::min(quota_, n - got));
+    got += k;
+    quota_ -= k;
+  }
+  return got;
+}
+
+#endif  // FAN_IN_H
@@ -0,0 +1,221 @@
+// MirroredChannel is a wait-free ring-buffer for inter-thread
+// communication whose memory is mapped twice, back to back, so that any
+// run of items in it is contiguous, even across the end of the ring. It
+// is safe with one sender and one receiver. T must be trivially
+// copyable. Linux only.
+
+#ifndef MIRRORED_CHANNEL_H
+#define MIRRORED_CHANNEL_H
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+#include "channel.h"
+
+template <class T>
+class MirroredChannel {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "MirroredChannel items must be trivially copyable");
+  static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                "No guarantee that MirroredChannel is lock-free on this "
+                "platform");
+
+public:
+  // Create maps a channel for at least capacity items. The ring is
+  // rounded up to whole pages, so the capacity may grow. It returns
+  // null if the memory cannot be mapped.
+  static std::unique_ptr<MirroredChannel> Create(int capacity);
+
+  ~MirroredChannel() { munmap(buf_, 2 * Bytes(size_)); }
+
+  // The number of items the channel holds.
+  int capacity() const { return size_; }
+
+  // Send attempts to put an item onto the channel. It returns true if
+  // it succeeded (the channel was not already full).
+  bool Send(const T &item) { return SendN(&item, 1) == 1; }
+
+  // Receive attempts to take an item from the channel. It return true
+  // if it succeeded (the channel was not already empty).
+  bool Receive(T* item) { return ReceiveN(item, 1) == 1; }
+
+  // SendN puts up to n items onto the channel with a single copy and
+  // returns how many it put.
+  int SendN(const T *items, int n);
+
+  // ReceiveN takes up to n items from the channel with a single copy
+  // and returns how many it took.
+  int ReceiveN(T* items, int n);
+
+  // Reserve returns how many free slots, up to n, follow *slots. They
+  // are contiguous wherever the ring wraps. The receiver sees nothing
+  // until Commit.
+  int Reserve(int n, T** slots);
+
+  // Commit publishes the first n slots from the last Reserve.
+  void Commit(int n);
+
+  // Peek returns how many items, up to n, follow *items. They are
+  // contiguous wherever the ring wraps, so they can be handed straight
+  // to memcpy, write(2) or a codec. The slots stay owned by the
+  // receiver until Release.
+  int Peek(int n, T** items);
+
+  // Release hands the first n items from the last Peek back to the
+  // sender.
+  void Release(int n);
+
+private:
+  MirroredChannel(T* buf, int size)
+      : size_(size), buf_(buf), r_(0), w_cache_(0), r_pos_(0),
+        w_(0), r_cache_(0), w_pos_(0) {}
+
+  static size_t Bytes(int size) { return sizeof(T) * size; }
+
+  int Wrap(int pos) const { return pos >= size_ ? pos - size_ : pos; }
+
+  // Writable returns how many of n items fit after w, refreshing
+  // r_cache_ if the cached view is not enough.
+  int Writable(uint32_t w, int n);
+
+  // Readable returns how many of n items are waiting at r, refreshing
+  // w_cache_ if the cached view is not enough.
+  int Readable(uint32_t r, int n);
+
+  // Read-only after construction. buf_[i] and buf_[i + size_] are the
+  // same memory.
+  alignas(kCacheLineSize) int size_;
+  T *buf_;
+
+  // As in Channel, r_ and w_ count every item ever received and sent,
+  // and each side tracks the slot its counter points at.
+
+  // Owned by the receiver. w_cache_ is the receiver's last view of w_.
+  alignas(kCacheLineSize) std::atomic<uint32_t> r_;
+  uint32_t w_cache_;
+  int r_pos_;
+
+  // Owned by the sender. r_cache_ is the sender's last view of r_.
+  alignas(kCacheLineSize) std::atomic<uint32_t> w_;
+  uint32_t r_cache_;
+  int w_pos_;
+};
+
+template <class T>
+std::unique_ptr<MirroredChannel<T>> MirroredChannel<T>::Create(int capacity) {
+  assert(capacity > 0);
+  // The ring must be a whole number of pages and a whole number of
+  // items.
+  const size_t page = sysconf(_SC_PAGESIZE);
+  size_t bytes = (Bytes(capacity) + page - 1) / page * page;
+  while (bytes % sizeof(T) != 0) {
+    bytes += page;
+  }
+
+  const int fd = memfd_create("MirroredChannel", MFD_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  char* addr = static_cast<char*>(MAP_FAILED);
+  if (ftruncate(fd, bytes) == 0) {
+    // Reserve room for both copies, then map the file over each half.
+    addr = static_cast<char*>(mmap(nullptr, 2 * bytes, PROT_NONE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  }
+  if (addr != MAP_FAILED &&
+      (mmap(addr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            fd, 0) == MAP_FAILED ||
+       mmap(addr + bytes, bytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+    munmap(addr, 2 * bytes);
+    addr = static_cast<char*>(MAP_FAILED);
+  }
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  return std::unique_ptr<MirroredChannel>(new MirroredChannel(
+      reinterpret_cast<T*>(addr), static_cast<int>(bytes / sizeof(T))));
+}
+
+template <class T>
+int MirroredChannel<T>::Writable(uint32_t w, int n) {
+  int space = size_ - static_cast<int>(w - r_cache_);
+  if (space < n) {
+    r_cache_ = r_.load(std::memory_order_acquire); // observe any reads
+    space = size_ - static_cast<int>(w - r_cache_);
+  }
+  return n < space ? n : space;
+}
+
+template <class T>
+int MirroredChannel<T>::Readable(uint32_t r, int n) {
+  int avail = static_cast<int>(w_cache_ - r);
+  if (avail < n) {
+    w_cache_ = w_.load(std::memory_order_acquire); // observe any writes
+    avail = static_cast<int>(w_cache_ - r);
+  }
+  return n < avail ? n : avail;
+}
+
+template <class T>
+int MirroredChannel<T>::SendN(const T *items, int n) {
+  T* slots;
+  n = Reserve(n, &slots);
+  if (n <= 0) {
+    return 0;
+  }
+  memcpy(slots, items, Bytes(n));
+  Commit(n);
+  return n;
+}
+
+template <class T>
+int MirroredChannel<T>::ReceiveN(T* items, int n) {
+  T* slots;
+  n = Peek(n, &slots);
+  if (n <= 0) {
+    return 0;
+  }
+  memcpy(items, slots, Bytes(n));
+  Release(n);
+  return n;
+}
+
+template <class T>
+int MirroredChannel<T>::Reserve(int n, T** slots) {
+  const uint32_t w = w_.load(std::memory_order_relaxed); // we own w_
+  *slots = buf_ + w_pos_;
+  return Writable(w, n);
+}
+
+template <class T>
+void MirroredChannel<T>::Commit(int n) {
+  const uint32_t w = w_.load(std::memory_order_relaxed); // we own w_
+  w_pos_ = Wrap(w_pos_ + n);
+  w_.store(w+n, std::memory_order_release); // publish the writes
+}
+
+template <class T>
+int MirroredChannel<T>::Peek(int n, T** items) {
+  const uint32_t r = r_.load(std::memory_order_relaxed); // we own r_
+  *items = buf_ + r_pos_;
+  return Readable(r, n);
+}
+
+template <class T>
+void MirroredChannel<T>::Release(int n) {
+  const uint32_t r = r_.load(std::memory_order_relaxed); // we own r_
+  r_pos_ = Wrap(r_pos_ + n);
+  r_.store(r+n, std::memory_order_release); // publish the reads
+}
+
+#endif  // MIRRORED_CHANNEL_H
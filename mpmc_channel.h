@@ -0,0 +1,46 @@
+// MpmcChannel is a lock-free ring-buffer for inter-thread
+// communication. It is safe with many senders and many receivers; each
+// item is received exactly once.
+
+#ifndef MPMC_CHANNEL_H
+#define MPMC_CHANNEL_H
+
+#include <utility>
+
+#include "seq_ring.h"
+
+template <class T>
+class MpmcChannel {
+public:
+  // Create a channel. The capacity is rounded up to a power of 2.
+  explicit MpmcChannel(int capacity) : ring_(capacity) {}
+
+  // The number of items the channel can hold.
+  int capacity() const { return ring_.capacity(); }
+
+  // Send attempts to put an item onto the channel. It returns true if
+  // it succeeded (the channel was not already full). The item is only
+  // moved from on success. Any thread may call it.
+  bool Send(const T &item) { return ring_.Emplace(item); }
+  bool Send(T &&item) { return ring_.Emplace(std::move(item)); }
+
+  // Emplace is Send with the item constructed from args directly in
+  // the ring.
+  template <class... Args>
+  bool Emplace(Args&&... args) {
+    return ring_.Emplace(std::forward<Args>(args)...);
+  }
+
+  // Receive attempts to take an item from the channel. It return true
+  // if it succeeded (the channel was not already empty). The item is
+  // moved out of the ring and its slot destroyed. Any thread may
+  // call it.
+  bool Receive(T* item) { return ring_.Receive(item); }
+
+private:
+  // Both sides race for their index with a compare-and-swap.
+  channel_internal::SeqRing<T, channel_internal::SharedIndex,
+                            channel_internal::SharedIndex> ring_;
+};
+
+#endif  // MPMC_CHANNEL_H
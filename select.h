@@ -0,0 +1,177 @@
+// Selector lets one receiving thread wait on several Channels at once,
+// even Channels of different item types, and sleep on a single futex
+// that whichever sender publishes first wakes. Linux only, like
+// FutexWait.
+//
+// Each Channel must be made with SelectableWait as its WaitStrategy:
+//
+//   Channel<Request, 64, SelectableWait> requests;
+//   Channel<Reply, 64, SelectableWait> replies;
+//   Selector s;
+//   const int kRequests = s.Add(&requests);
+//   const int kReplies = s.Add(&replies);
+//   for (;;) {
+//     const int i = s.Select();
+//     if (i == kRequests) { ... requests.TryReceive(&req) ... }
+//   }
+
+#ifndef SELECT_H
+#define SELECT_H
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <vector>
+
+#include "channel.h"
+
+// SelectableWait is FutexWait that a Selector can redirect to its own
+// futex, so that the sender wakes the Selector's thread. Both sides
+// use whichever futex is current; switching it while somebody waits on
+// the channel is not allowed.
+class SelectableWait {
+public:
+  SelectableWait() : target_(&own_) {}
+
+  template <class Ready>
+  void Wait(Ready ready) {
+    target_.load(std::memory_order_acquire)->Wait(ready);
+  }
+
+  template <class Ready, class Clock, class Duration>
+  bool WaitUntil(Ready ready,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    return target_.load(std::memory_order_acquire)->WaitUntil(ready,
+                                                              deadline);
+  }
+
+  void Notify() { target_.load(std::memory_order_acquire)->Notify(); }
+
+  // Attach sends Waits and Notifies to shared instead; null goes back to
+  // this instance's own futex.
+  void Attach(FutexWait* shared) {
+    target_.store(shared != nullptr ? shared : &own_,
+                  std::memory_order_release);
+  }
+
+private:
+  FutexWait own_;
+  std::atomic<FutexWait*> target_;
+};
+
+// Selector belongs to the receiver of every Channel added to it, and is
+// only for that one thread.
+class Selector {
+public:
+  // kPriority always prefers the Channel added first; kRoundRobin
+  // starts each Select after the Channel it returned last, so a busy
+  // Channel cannot starve the others.
+  enum Fairness { kPriority, kRoundRobin };
+
+  explicit Selector(Fairness fairness = kRoundRobin)
+      : fairness_(fairness), next_(0) {}
+
+  // Add attaches a Channel, which must outlive the Selector or be
+  // removed first, and returns its index for Select to return. Add a
+  // Channel before its sender starts sending; a send racing with Add
+  // may notify the Channel's own futex and not wake Select.
+  template <class C>
+  int Add(C* c) {
+    c->readable().Attach(&parking_);
+    inputs_.push_back(Input{c, &Ready<C>, &Detach<C>});
+    return static_cast<int>(inputs_.size()) - 1;
+  }
+
+  // Remove detaches the Channel at index i; Select no longer returns it.
+  // Only remove a Channel once its sender has stopped sending, for
+  // example once TryReceive reports kClosed: a send racing with Remove
+  // may still notify the Selector instead of the Channel, and so never
+  // wake a receiver that goes on to wait on the Channel itself. A
+  // Channel that is closed and drained is always ready, so remove it
+  // then anyway.
+  void Remove(int i) {
+    if (inputs_[i].channel != nullptr) {
+      inputs_[i].detach(inputs_[i].channel);
+      inputs_[i].channel = nullptr;
+    }
+  }
+
+  // Destroy a Selector only once every attached Channel's sender has
+  // returned from its last Send or Close, by joining it, say. A sender
+  // that has already loaded the Selector's futex notifies it after
+  // publishing, so seeing an item or kClosed is not enough: the
+  // notify may still be on its way, and would land on freed memory.
+  ~Selector() {
+    for (int i = 0; i < static_cast<int>(inputs_.size()); ++i) {
+      Remove(i);
+    }
+  }
+
+  // Poll returns the index of a Channel with an item waiting or that is
+  // closed, or -1 if there is none.
+  int Poll();
+
+  // Select returns the index of a ready Channel, sleeping until there
+  // is one.
+  int Select() {
+    int i;
+    parking_.Wait([&] { return (i = Poll()) >= 0; });
+    return i;
+  }
+
+  // SelectUntil is Select that returns -1 once the deadline passes.
+  template <class Clock, class Duration>
+  int SelectUntil(const std::chrono::time_point<Clock, Duration> &deadline) {
+    int i = -1;
+    parking_.WaitUntil([&] { return (i = Poll()) >= 0; }, deadline);
+    return i;
+  }
+
+private:
+  // An Input is a Channel with its type erased.
+  struct Input {
+    void *channel;
+    bool (*ready)(void* channel);
+    void (*detach)(void* channel);
+  };
+
+  template <class C>
+  static bool Ready(void* channel) {
+    C* c = static_cast<C*>(channel);
+    return !c->empty() || c->closed();
+  }
+
+  template <class C>
+  static void Detach(void* channel) {
+    static_cast<C*>(channel)->readable().Attach(nullptr);
+  }
+
+  Selector(const Selector&) = delete;
+  Selector& operator=(const Selector&) = delete;
+
+  const Fairness fairness_;
+  int next_;
+  std::vector<Input> inputs_;
+
+  // Every attached Channel's sender notifies parking_.
+  FutexWait parking_;
+};
+
+inline int Selector::Poll() {
+  const int n = static_cast<int>(inputs_.size());
+  const int start = fairness_ == kRoundRobin ? next_ : 0;
+  for (int k = 0; k < n; ++k) {
+    int i = start + k;
+    if (i >= n) {
+      i -= n;
+    }
+    const Input &in = inputs_[i];
+    if (in.channel != nullptr && in.ready(in.channel)) {
+      next_ = i + 1 == n ? 0 : i + 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+#endif  // SELECT_H
@@ -0,0 +1,174 @@
+// SeqRing is the ring behind MpscChannel, SpmcChannel and MpmcChannel.
+// Each side of it advances either an index of its own or one shared
+// with other threads, and the three channels only differ in which.
+
+#ifndef SEQ_RING_H
+#define SEQ_RING_H
+
+#include <atomic>
+#include <cassert>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "channel.h"
+
+namespace channel_internal {
+
+// OwnedIndex is an index advanced by one thread only, with plain loads
+// and stores.
+class OwnedIndex {
+public:
+  OwnedIndex() : i_(0) {}
+
+  unsigned Load() const { return i_; }
+
+  // Claim takes index i, which is always still current.
+  bool Claim(unsigned* i) {
+    i_ = *i + 1;
+    return true;
+  }
+
+private:
+  unsigned i_;
+};
+
+// SharedIndex is an index that many threads race to advance with a
+// compare-and-swap.
+class SharedIndex {
+public:
+  SharedIndex() : i_(0) {}
+
+  unsigned Load() const { return i_.load(std::memory_order_relaxed); }
+
+  // Claim tries to take index *i. If another thread took it first, it
+  // returns false and sets *i to the current index.
+  bool Claim(unsigned* i) {
+    return i_.compare_exchange_weak(*i, *i + 1, std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<unsigned> i_;
+};
+
+// A slot's seq says whose turn it is: the sender with write index w may
+// fill it when seq == w, and the receiver with read index r may take it
+// when seq == r+1. A side only claims an index once it has seen that
+// the slot is ready for it, and only hands the slot over once it is
+// done with it, so senders and receivers only ever meet on the slot
+// itself and never see a half-written item.
+//
+// The item is constructed in the slot by its sender and destroyed by
+// its receiver, so a slot never keeps a received item alive. The
+// capacity is rounded up to a power of 2.
+template <class T, class SendIndex, class ReceiveIndex>
+class SeqRing {
+  static_assert(std::atomic<unsigned>::is_always_lock_free,
+                "No guarantee that the channel is lock-free on this platform");
+
+public:
+  explicit SeqRing(int capacity) {
+    assert(capacity > 0);
+    size_ = 1;
+    while (size_ < capacity) {
+      size_ <<= 1;
+    }
+    size_mask_ = size_ - 1;
+    slots_ = new Slot[size_];
+    for (int i = 0; i < size_; ++i) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  ~SeqRing() {
+    const unsigned w = w_.Load();
+    for (unsigned r = r_.Load(); r != w; ++r) {
+      slots_[r & size_mask_].item()->~T();
+    }
+    delete[] slots_;
+  }
+
+  int capacity() const { return size_; }
+
+  template <class... Args>
+  bool Emplace(Args&&... args);
+
+  bool Receive(T* item);
+
+private:
+  struct Slot {
+    std::atomic<unsigned> seq;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+    T* item() { return reinterpret_cast<T*>(&storage); }
+  };
+
+  // Claim takes the next index from index once its slot's seq is
+  // index + offset, and returns it in *claimed. It returns false if the
+  // slot is not ready yet (the ring is full or empty).
+  template <class Index>
+  bool Claim(Index* index, unsigned offset, unsigned* claimed);
+
+  SeqRing(const SeqRing&) = delete;
+  SeqRing& operator=(const SeqRing&) = delete;
+
+  // Read-only after construction.
+  alignas(kCacheLineSize) int size_, size_mask_;
+  Slot *slots_;
+
+  alignas(kCacheLineSize) ReceiveIndex r_;
+  alignas(kCacheLineSize) SendIndex w_;
+};
+
+template <class T, class SendIndex, class ReceiveIndex>
+template <class Index>
+bool SeqRing<T, SendIndex, ReceiveIndex>::Claim(Index* index,
+                                                unsigned offset,
+                                                unsigned* claimed) {
+  unsigned i = index->Load();
+  for (;;) {
+    const unsigned seq = slots_[i & size_mask_].seq.load(
+        std::memory_order_acquire); // observe the other side
+    const int turn = static_cast<int>(seq - (i + offset));
+    if (turn == 0) {
+      // The slot is ready; claim index i. On failure i is reloaded.
+      if (index->Claim(&i)) {
+        *claimed = i;
+        return true;
+      }
+    } else if (turn < 0) {
+      return false; // the other side has not finished with this slot
+    } else {
+      i = index->Load(); // another thread on this side got here first
+    }
+  }
+}
+
+template <class T, class SendIndex, class ReceiveIndex>
+template <class... Args>
+bool SeqRing<T, SendIndex, ReceiveIndex>::Emplace(Args&&... args) {
+  unsigned w;
+  if (!Claim(&w_, 0, &w)) {
+    return false;
+  }
+  Slot &slot = slots_[w & size_mask_];
+  new (slot.item()) T(std::forward<Args>(args)...);
+  slot.seq.store(w+1, std::memory_order_release); // publish the write
+  return true;
+}
+
+template <class T, class SendIndex, class ReceiveIndex>
+bool SeqRing<T, SendIndex, ReceiveIndex>::Receive(T* item) {
+  unsigned r;
+  if (!Claim(&r_, 1, &r)) {
+    return false;
+  }
+  Slot &slot = slots_[r & size_mask_];
+  *item = std::move(*slot.item());
+  slot.item()->~T();
+  slot.seq.store(r + size_, std::memory_order_release); // free the slot
+  return true;
+}
+
+}  // namespace channel_internal
+
+#endif  // SEQ_RING_H
@@ -0,0 +1,216 @@
+// ShmChannel is a wait-free ring-buffer in shared memory for
+// inter-process communication. It is safe with one sending process and
+// one receiving process. T must be trivially copyable, since items are
+// copied between address spaces byte for byte.
+
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include "channel.h"
+
+template <class T>
+class ShmChannel {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "ShmChannel items must be trivially copyable");
+  static_assert(alignof(T) <= kCacheLineSize,
+                "ShmChannel items must not be over-aligned");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "No guarantee that ShmChannel is lock-free on this platform");
+
+public:
+  // Create makes a new channel in shared memory called name, as for
+  // shm_open (e.g. "/audio-frames"), and maps it. It returns null if the
+  // name is taken or the memory cannot be mapped.
+  static std::unique_ptr<ShmChannel> Create(const char* name, int capacity);
+
+  // Open maps a channel that another process made with Create. It
+  // returns null if there is no such channel, if it is not finished
+  // being created, or if it was created by an incompatible version or
+  // for a different item size.
+  static std::unique_ptr<ShmChannel> Open(const char* name);
+
+  // Unlink removes the name; processes that have the channel mapped
+  // keep using it.
+  static bool Unlink(const char* name) { return shm_unlink(name) == 0; }
+
+  ~ShmChannel() { munmap(header_, length_); }
+
+  // The capacity passed to Create.
+  int capacity() const { return header_->capacity; }
+
+  // Send attempts to put an item onto the channel. It returns true if
+  // it succeeded (the channel was not already full).
+  bool Send(const T &item);
+
+  // Receive attempts to take an item from the channel. It return true
+  // if it succeeded (the channel was not already empty).
+  bool Receive(T* item);
+
+  // SendWait puts an item onto the channel, sleeping on a futex shared
+  // with the other process while it is full.
+  void SendWait(const T &item) {
+    header_->writable.Wait([&] { return Send(item); });
+  }
+
+  // ReceiveWait takes an item from the channel, sleeping on a futex
+  // shared with the other process while it is empty.
+  void ReceiveWait(T* item) {
+    header_->readable.Wait([&] { return Receive(item); });
+  }
+
+private:
+  static const uint32_t kMagic = 0x434d4853;
+  static const uint32_t kVersion = 1;
+
+  // Header is at the start of the shared memory and the slots follow
+  // it. Everything in it must work at any address, so the ring is
+  // located by offset rather than by pointer. magic is written last by
+  // the creator, so an opener that sees it sees the rest. The counters
+  // are 64 bits so that they never wrap, which lets a process that
+  // attaches late find its slot as counter % capacity.
+  struct Header {
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    uint32_t item_size;
+    int32_t capacity;
+
+    alignas(kCacheLineSize) std::atomic<uint64_t> r;
+    alignas(kCacheLineSize) std::atomic<uint64_t> w;
+
+    alignas(kCacheLineSize) SharedFutexWait readable;
+    alignas(kCacheLineSize) SharedFutexWait writable;
+  };
+
+  ShmChannel(Header* header, size_t length)
+      : header_(header), length_(length),
+        slots_(reinterpret_cast<T*>(header + 1)),
+        r_cache_(header->r.load(std::memory_order_relaxed)),
+        w_cache_(header->w.load(std::memory_order_relaxed)) {
+    r_pos_ = r_cache_ % header->capacity;
+    w_pos_ = w_cache_ % header->capacity;
+  }
+
+  static size_t Length(int capacity) {
+    return sizeof(Header) + sizeof(T) * static_cast<size_t>(capacity);
+  }
+
+  int Wrap(int pos) const {
+    return pos >= header_->capacity ? pos - header_->capacity : pos;
+  }
+
+  Header *header_;
+  size_t length_;
+  T *slots_;
+
+  // This process's side of the channel: the cached view of the other
+  // side's counter and the slot our own counter points at. Only one of
+  // each pair is used, depending on whether we send or receive.
+  uint64_t r_cache_, w_cache_;
+  int r_pos_, w_pos_;
+};
+
+template <class T>
+std::unique_ptr<ShmChannel<T>> ShmChannel<T>::Create(const char* name,
+                                                     int capacity) {
+  assert(capacity > 0);
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+  const size_t length = Length(capacity);
+  void* addr = MAP_FAILED;
+  if (ftruncate(fd, length) == 0) {
+    addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (addr == MAP_FAILED) {
+    shm_unlink(name);
+    return nullptr;
+  }
+  // The counters start at 0, so r_pos_ and w_pos_ do too. The memory
+  // starts zeroed, which is also the initial state of both futexes.
+  Header* header = new (addr) Header;
+  header->version = kVersion;
+  header->item_size = sizeof(T);
+  header->capacity = capacity;
+  header->r.store(0, std::memory_order_relaxed);
+  header->w.store(0, std::memory_order_relaxed);
+  header->magic.store(kMagic, std::memory_order_release);
+  return std::unique_ptr<ShmChannel>(new ShmChannel(header, length));
+}
+
+template <class T>
+std::unique_ptr<ShmChannel<T>> ShmChannel<T>::Open(const char* name) {
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void* addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+    addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+  }
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  Header* header = static_cast<Header*>(addr);
+  const size_t length = st.st_size;
+  if (header->magic.load(std::memory_order_acquire) != kMagic ||
+      header->version != kVersion || header->item_size != sizeof(T) ||
+      header->capacity <= 0 || Length(header->capacity) != length) {
+    munmap(addr, length);
+    return nullptr;
+  }
+  return std::unique_ptr<ShmChannel>(new ShmChannel(header, length));
+}
+
+template <class T>
+bool ShmChannel<T>::Send(const T &item) {
+  const uint64_t w = header_->w.load(std::memory_order_relaxed); // we own w
+  const uint64_t cap = header_->capacity;
+  if (w - r_cache_ == cap) {
+    r_cache_ = header_->r.load(std::memory_order_acquire); // observe any reads
+    if (w - r_cache_ == cap) {
+      return false;
+    }
+  }
+  slots_[w_pos_] = item;
+  w_pos_ = Wrap(w_pos_ + 1);
+  header_->w.store(w+1, std::memory_order_release); // publish the write
+  header_->readable.Notify();
+  return true;
+}
+
+template <class T>
+bool ShmChannel<T>::Receive(T* item) {
+  const uint64_t r = header_->r.load(std::memory_order_relaxed); // we own r
+  if (r == w_cache_) {
+    w_cache_ = header_->w.load(std::memory_order_acquire); // observe any writes
+    if (r == w_cache_) {
+      return false;
+    }
+  }
+  *item = slots_[r_pos_];
+  r_pos_ = Wrap(r_pos_ + 1);
+  header_->r.store(r+1, std::memory_order_release); // publish the read
+  header_->writable.Notify();
+  return true;
+}
+
+#endif  // SHM_CHANNEL_H
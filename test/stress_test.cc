@@ -0,0 +1,241 @@
+// stress_test hammers the two hand-offs that are easiest to get wrong:
+// FanIn's summary bitmap, which the receiver clears and then rechecks
+// while senders set it, and the rendezvous Channel<T, 0>, where either
+// side may be blocked with an offer out while the other polls. A lost
+// bit or a lost offer hangs the test, so a watchdog fails it instead.
+// Build it with ThreadSanitizer to check the orderings too:
+//
+//   g++ -std=c++17 -pthread -fsanitize=thread -I.. stress_test.cc -o stress
+//   ./stress [rounds]
+//
+// GCC warns that TSan does not model atomic_thread_fence; the fences
+// in FanIn and FutexWait only order atomics, so no report depends on
+// them.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "channel.h"
+#include "fan_in.h"
+
+namespace {
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                 \
+      abort();                                                        \
+    }                                                                 \
+  } while (0)
+
+// Watchdog fails the test if it is still running after a deadline,
+// which is how a lost wake-up shows.
+class Watchdog {
+public:
+  Watchdog(const char* name, std::chrono::seconds limit)
+      : done_(false), thread_([this, name, limit] {
+          const auto deadline = std::chrono::steady_clock::now() + limit;
+          while (!done_.load()) {
+            if (std::chrono::steady_clock::now() > deadline) {
+              fprintf(stderr, "%s: stuck, a wake-up was lost\n", name);
+              abort();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+          }
+        }) {}
+  ~Watchdog() {
+    done_.store(true);
+    thread_.join();
+  }
+
+private:
+  std::atomic<bool> done_;
+  std::thread thread_;
+};
+
+// Pause makes a thread stall now and then, so that lanes and offers go
+// empty and the slow paths run.
+void Pause(long i) {
+  if (i % 7 == 0) {
+    std::this_thread::yield();
+  }
+}
+
+// FanInBitmap has each sender send a burst of one item into each of its
+// lanes of a FanIn with more than 64 lanes, and then wait for the
+// receiver to take the burst, while the receiver takes in every way it
+// can. Every item is thus the last in its lane for a while, so a bit
+// cleared while its lane had an item leaves the receiver asleep with
+// work waiting. Each item is its lane times kStride plus its index in
+// the lane, and each lane's items must arrive in order.
+void FanInBitmap(long per_lane) {
+  const int kLanes = 70;  // more than one summary word
+  const int kSenders = 4;
+  const long kStride = 1L << 32;
+  FanIn<long, 8, FutexWait> in(kLanes);
+  in.SetWeight(3, 4);
+  Watchdog watchdog("FanInBitmap", std::chrono::seconds(60));
+  std::unique_ptr<std::atomic<long>[]> taken(
+      new std::atomic<long>[kSenders]);
+  for (int s = 0; s < kSenders; ++s) {
+    taken[s].store(0);
+  }
+  std::vector<std::thread> senders;
+  for (int s = 0; s < kSenders; ++s) {
+    senders.emplace_back([&, s] {
+      // Sender s owns lanes s, s + kSenders, ...
+      long sent = 0;
+      for (long i = 0; i < per_lane; ++i) {
+        for (int lane = s; lane < kLanes; lane += kSenders) {
+          const long item = lane * kStride + i;
+          if (!in.Send(lane, item)) {
+            in.SendWait(lane, item);
+          }
+          ++sent;
+        }
+        while (taken[s].load() != sent) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  std::vector<long> next(kLanes, 0);
+  const long total = per_lane * kLanes;
+  long got = 0;
+  long round = 0;
+  for (long misses = 0; got < total;) {
+    long items[5];
+    int n;
+    switch (round % 3) {
+      case 0:
+        in.ReceiveWait(items);
+        n = 1;
+        break;
+      case 1:
+        n = in.Receive(items) ? 1 : 0;
+        break;
+      default:
+        n = in.ReceiveN(items, 5);
+        break;
+    }
+    for (int k = 0; k < n; ++k) {
+      const int lane = static_cast<int>(items[k] / kStride);
+      CHECK(lane >= 0 && lane < kLanes);
+      CHECK(items[k] % kStride == next[lane]);
+      ++next[lane];
+      ++taken[lane % kSenders];
+    }
+    got += n;
+    // Poll through a run of misses before blocking again, so that the
+    // receiver is also caught between clearing a bit and rechecking.
+    if (n > 0 || ++misses % 10000 == 0) {
+      ++round;
+    }
+  }
+  for (std::thread &t : senders) {
+    t.join();
+  }
+  for (int lane = 0; lane < kLanes; ++lane) {
+    CHECK(next[lane] == per_lane);
+  }
+  long extra;
+  CHECK(!in.Receive(&extra));
+}
+
+// RendezvousPolling pairs a blocking side with a polling side, both
+// ways round. The polling side must take or give an item whenever the
+// blocking side has an offer out, or the test hangs. It yields between
+// polls so that one CPU is enough.
+template <class WaitStrategy>
+void RendezvousPolling(long items) {
+  Watchdog watchdog("RendezvousPolling", std::chrono::seconds(60));
+  {
+    Channel<std::unique_ptr<long>, 0, WaitStrategy> c;
+    std::thread sender([&] {
+      for (long i = 0; i < items; ++i) {
+        c.SendWait(std::unique_ptr<long>(new long(i)));
+        Pause(i);
+      }
+    });
+    std::unique_ptr<long> item;
+    for (long i = 0; i < items;) {
+      if (c.Receive(&item)) {
+        CHECK(*item == i);
+        ++i;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    sender.join();
+  }
+  {
+    Channel<long, 0, WaitStrategy> c;
+    std::thread receiver([&] {
+      long item;
+      for (long i = 0; i < items; ++i) {
+        c.ReceiveWait(&item);
+        CHECK(item == i);
+        Pause(i);
+      }
+    });
+    for (long i = 0; i < items;) {
+      if (c.Send(i)) {
+        ++i;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    receiver.join();
+  }
+}
+
+// RendezvousTimeouts has both sides block with short deadlines, so that
+// offers race with each other and are often withdrawn just as the other
+// side claims them. An item is handed over exactly when SendFor says it
+// was, so the receiver sees every sent item once, in order.
+void RendezvousTimeouts(long items) {
+  Watchdog watchdog("RendezvousTimeouts", std::chrono::seconds(60));
+  Channel<std::unique_ptr<long>, 0, FutexWait> c;
+  std::atomic<long> sent(0);
+  std::thread sender([&] {
+    for (long i = 0; i < items;) {
+      std::unique_ptr<long> item(new long(i));
+      if (c.SendFor(std::move(item), std::chrono::microseconds(20))) {
+        sent.store(++i);
+      } else {
+        CHECK(item != nullptr && *item == i);  // not moved from
+      }
+    }
+  });
+  std::unique_ptr<long> item;
+  for (long i = 0; i < items;) {
+    if (c.ReceiveFor(&item, std::chrono::microseconds(30))) {
+      CHECK(*item == i);
+      ++i;
+    }
+  }
+  sender.join();
+  CHECK(sent.load() == items);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const long rounds = argc > 1 ? atol(argv[1]) : 2000;
+  if (rounds < 1) {
+    fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+    return 1;
+  }
+  FanInBitmap(rounds);
+  RendezvousPolling<FutexWait>(rounds * 10);
+  RendezvousPolling<YieldingWait>(rounds * 10);
+  RendezvousTimeouts(rounds);
+  printf("PASS\n");
+  return 0;
+}